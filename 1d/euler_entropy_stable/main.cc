@@ -4,15 +4,23 @@
 #include <cmath>
 #include <string>
 #include <sstream>
+#include <iomanip>
 #include <stdio.h>
 #include <stdlib.h>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <new>
+
+#include "logavg.h"
 
 enum ReconstructionScheme { FIRST, MINMOD, VANLEER, WENO};
 
 enum FluxScheme {KEPSSENT, ROE, ROEFIXED, RUSANOV};
 
-enum TimeIntegrationScheme{RK1, SSPRK3, JAMESON_RK4};
+enum TimeIntegrationScheme{RK1, SSPRK3, JAMESON_RK4, LSRK3, LSRK4};
+
+enum OutputFormat {DAT, BIN};
 
 #define SIGN(a) (((a)<0) ? -1:1)
 #define Cp  (GAMMA * gas_const / (GAMMA - 1.0))
@@ -22,60 +30,58 @@ const double arks[] = {0.0, 3.0/4.0, 1.0/3.0};
 const double brks[] = {1.0, 1.0/4.0, 2.0/3.0};
 const double jameson_rks[] = {1.0/4.0,1.0/3.0,1.0/2.0, 1.0};
 
-// These values are set below based on test case type
-double GAMMA;
-double gas_const;
-double K2, K4;
-double beta_upwind,alpha,beta_upwind_cen,alpha_cen; // factor for increasing wave speed
-double nrk; // no. of rk stages: 1 or 3 only
-
-unsigned int counter = 0; // For solution storage
+// Low storage (2N) schemes: du = a du + dt L(u), u = u + b du at each stage
+// Williamson, three stages, third order
+const double ls3a[] = {0.0, -5.0/9.0, -153.0/128.0};
+const double ls3b[] = {1.0/3.0, 15.0/16.0, 8.0/15.0};
+// Carpenter and Kennedy, five stages, fourth order
+const double ls4a[] = {0.0,
+                       -567301805773.0/1357537059087.0,
+                       -2404267990393.0/2016746695238.0,
+                       -3550918686646.0/2091501179385.0,
+                       -1275806237668.0/842570457699.0};
+const double ls4b[] = {1432997174477.0/9575080441755.0,
+                       5161836677717.0/13612068292357.0,
+                       1720146321549.0/2090206949498.0,
+                       3134564353537.0/4481467310338.0,
+                       2277821191437.0/14882151754819.0};
 
 using namespace std;
 
-void con2prim (vector<double>& con, vector<double>& prim);
+// State of a cell or a face: conserved or primitive variables, residual, flux
+#define NVAR 3
+typedef array<double,NVAR> State;
 
+// With OpenMP, loops over cells and faces use several threads from this size
+#define OMP_MIN_CELLS 10000
 
+// Adaptive time step: give up after this many rejections of one step, or
+// when dt falls below DT_MIN_REL * final_time
+#define MAX_REJECT 50
+#define DT_MIN_REL 1.0e-12
 
 //------------------------------------------------------------------------------
+// Count heap allocations, to check that a time step makes none
 //------------------------------------------------------------------------------
-double logavg(double a, double b)
-{
-   double xi = b/a;
-   double f = (xi - 1.0) / (xi + 1.0);
-   double u = f * f;
-   
-   double F;
-   if (u < 1.0e-6)
-   {
-      double u2 = u * u;
-      double u3 = u2 * u;
-      F = 1.0 + u/3.0 + u2/5.0 + u3/7.0;
-   }
-   else
-      F = log(xi)/2.0/f;
-   
-   return 0.5*(a+b)/F;
-}
+unsigned long n_alloc = 0;
 
-
-//------------------------------------------------------------------------------
-// Compute temperature given primitive variables
-//------------------------------------------------------------------------------
-double temperature(const vector<double>& prim)
+void* operator new (size_t size)
 {
-   return prim[2] / (gas_const * prim[0]);
+#pragma omp atomic
+   ++n_alloc;
+   void *p = malloc(size);
+   if(p == NULL) throw bad_alloc();
+   return p;
 }
 
-//------------------------------------------------------------------------------
-// Compute temperature given primitive variables
-//------------------------------------------------------------------------------
-double enthalpy(const vector<double>& prim)
+void operator delete (void *p) noexcept
 {
-   return GAMMA * prim[2] / (prim[0] * (GAMMA-1.0)) + 
-          0.5 * pow(prim[1], 2);
+   free(p);
 }
 
+
+
+
 //------------------------------------------------------------------------------
 // Minmod of three numbers
 //------------------------------------------------------------------------------
@@ -137,12 +143,12 @@ double vanleer (const double& a,
 //------------------------------------------------------------------------------
 // Reconstruct left state of right face
 //------------------------------------------------------------------------------
-vector<double> muscl (const vector<double>& ul,
-                      const vector<double>& uc,
-                      const vector<double>& ur)
+State muscl (const State& ul,
+                      const State& uc,
+                      const State& ur)
 {
-   unsigned int n = ul.size();
-   vector<double> result (n);
+   const unsigned int n = ul.size();
+   State result;
    double dul, duc, dur;
    const double beta = 2.0;
    
@@ -204,28 +210,45 @@ class FVProblem
    public:
       FVProblem ();
       void run ();
+      void init ();
+      void step ();
+      bool done () const { return !(time < final_time && iter < max_iter); }
+      unsigned long cells () const { return (unsigned long)n_cell * iter; }
+      void write (ofstream& fo) const;
+      void read_parameters (const char *param_file);
+      void set_parameter (const string& param, const string& value);
+
+      bool verbose; // print progress and write sol*.dat files
    
    private:
+      // compute_residual for one flux and reconstruction scheme
+      typedef void (FVProblem::*Residual) ();
+
+      void set_test_case ();
       void make_grid_and_dofs ();
       void initial_condition ();
       void compute_dt ();
       void con_to_prim ();
+      void con2prim (const State& con, State& prim) const;
+      double temperature (const State& prim) const;
+      double enthalpy (const State& prim) const;
+      template <ReconstructionScheme recon>
       void reconstruct (const unsigned int face,
-                        vector<double>& left,
-                        vector<double>& right) const;               
-      void ent_diss_flux(const vector<double>& left,
-                                 const vector<double>& right,
+                        State& left,
+                        State& right) const;               
+      void ent_diss_flux(const State& left,
+                                 const State& right,
                                  double rho,
                                  double u,
                                  double a,
                                  double betal,
                                  double betar,
-                                 vector<double>& flux) const;
-      void ent_diss_flux_2(const vector<double>& left_m1,
-                              const vector<double>& left,
-                              const vector<double>& right,
-                              const vector<double>& right_p1,
-                              const vector<double>& right_p2,
+                                 State& flux) const;
+      void ent_diss_flux_2(const State& left_m1,
+                              const State& left,
+                              const State& right,
+                              const State& right_p1,
+                              const State& right_p2,
                               double rho_m1,
                               double u_m1,
                               double a_m1,
@@ -241,34 +264,38 @@ class FVProblem
                               double a_p1,
                               double betal_p1,
                               double betar_p1,
-                              vector<double>& flux) const  ;                       
-      void keps_ent_flux(const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>& flux) const;
+                              State& flux) const  ;                       
+      void keps_ent_flux(const State& left,
+                         const State& right,
+                         State& flux) const;
       void keps2_ent_flux(const int& f,
-                          const vector<double>& left,
-                          const vector<double>& right,
-                          vector<double>& flux) const;
-      void roe_flux(const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>& flux) const;
-      void roe_fixed_flux(const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>& flux) const;                   
-      void rusanov_flux ( const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>& flux) const;                             
+                          const State& left,
+                          const State& right,
+                          State& flux) const;
+      void roe_flux(const State& left,
+                         const State& right,
+                         State& flux) const;
+      void roe_fixed_flux(const State& left,
+                         const State& right,
+                         State& flux) const;                   
+      void rusanov_flux ( const State& left,
+                         const State& right,
+                         State& flux) const;                             
+      template <FluxScheme flux_type>
       void num_flux (const int&  f,
-                     const vector<double>&,
-                     const vector<double>&,
-                     vector<double>&) const;              
+                     const State&,
+                     const State&,
+                     State&) const;              
       void compute_face_values ();
+      template <FluxScheme flux_type, ReconstructionScheme recon>
       void compute_residual ();
       void compute_residual_norm ();
       void update_solution (const unsigned int rk);
+      void stages ();
       void update_ent_res(const unsigned int rk);
-      double entropy( const vector<double>& prim_var) const;                                            
+      double entropy( const State& prim_var) const;                                            
       void output ();
+      void output_bin ();
       double conval(int i, int j) const;
       
       FluxScheme flux_scheme;
@@ -278,8 +305,8 @@ class FVProblem
 
       double d_left, u_left, p_left;
       double d_right, u_right, p_right;
-      vector<double> prim_left;
-      vector<double> prim_right;
+      State prim_left;
+      State prim_right;
       unsigned int n_var;
       unsigned int n_cell;
       unsigned int n_face;
@@ -294,13 +321,13 @@ class FVProblem
       vector<double> xc;
       vector<double> xf;
    
-      vector< vector<double> > primitive;
-      vector< vector<double> > primitive_old;
-      vector< vector<double> > residual;
-      vector< vector<double> > conserved;
-      vector< vector<double> > conserved_old;
-      vector< vector<double> > conl, conr;
-      vector<double> res_norm;
+      vector<State> primitive;
+      vector<State> residual;
+      vector<State> conserved;
+      vector<State> conserved_old;
+      vector<State> conl, conr;
+      vector<State> face_flux;
+      State res_norm;
       
       double M; // Defining Mach numbers for the initial conditions
                  // of certain test cases
@@ -308,14 +335,59 @@ class FVProblem
       int test_case;
       
       int ent_diss_order; // order of entropy based matrix dissiaption
+
+      // These values are set in the constructor based on test case type
+      double GAMMA;
+      double gas_const;
+      double K2, K4;
+      double beta_upwind,alpha,beta_upwind_cen,alpha_cen; // factor for increasing wave speed
+      double nrk; // no. of rk stages, set in init from time_scheme
+      Residual compute_residual_fn; // set in init from flux_scheme and recon_scheme
+
+      // Error control of SSPRK3, if rtol > 0
+      double rtol, atol;
+      double err_norm;   // estimated error of the last step, relative to tolerance
+      double dt_next;    // time step proposed for the next step
+      unsigned long n_residual, n_reject;
+
+      unsigned int counter; // For solution storage
+      OutputFormat output_format;
+      bool output_single;         // BIN: float instead of double
+      unsigned int output_stride; // BIN: every output_stride'th cell
+      vector<double> obuf_d;
+      vector<float> obuf_f;
+      double time;
+      unsigned int iter;
 };
 
+//------------------------------------------------------------------------------
+// Compute temperature given primitive variables
+//------------------------------------------------------------------------------
+double FVProblem::temperature(const State& prim) const
+{
+   return prim[2] / (gas_const * prim[0]);
+}
+
+//------------------------------------------------------------------------------
+// Compute temperature given primitive variables
+//------------------------------------------------------------------------------
+double FVProblem::enthalpy(const State& prim) const
+{
+   return GAMMA * prim[2] / (prim[0] * (GAMMA-1.0)) + 
+          0.5 * pow(prim[1], 2);
+}
+
 //------------------------------------------------------------------------------
 // Constructor:
 // INSTRUCTIONS FOR PARAMETER SELECTION
 //
 // Choosing time integration scheme (time_scheme):
 //    RK1, SSPRK3, JAMESON_RK4
+//    LSRK3, LSRK4 : low storage, no copy of the solution is made in a step
+//
+// Adaptive time step with SSPRK3 (rtol > 0):
+//    The step is the smaller of the cfl one and the one for which the
+//    estimated error is rtol*|u| + atol; steps with larger error are redone.
 //
 // Choosing flux (flux_scheme):
 //    KEPSSENT     :: Exactly entropy conservative and kinetic energy preserving scheme with
@@ -346,45 +418,43 @@ class FVProblem
 //
 // Set test case by choosing from one of the available test cases
 //
+// These are the defaults; all of them, and n_cell, cfl, final_time, itermod
+// of the test case, can be changed at run time from a parameter file or the
+// command line, see set_parameter and main.
 //------------------------------------------------------------------------------
 FVProblem::FVProblem ()
+   :
+   verbose (true)
 {   
-   n_var  = 3;
-   
-   time_scheme = SSPRK3;
-   
-   if(time_scheme == RK1)
-      nrk = 1;
-   else if(time_scheme == SSPRK3)
-      nrk = 3;
-   else if(time_scheme == JAMESON_RK4)
-      nrk = 4;
-   else
-   {
-      cout<<"Unknown time integration scheme"<<endl;
-      cout<<"Possible options: RK1, RK3, JAMESON_RK4"<<endl; 
-   }           
+   n_var  = NVAR;
    
-   flux_scheme = KEPSSENT; 
-
+   test_case = 11;
+   flux_scheme = KEPSSENT;
    kepes_diss = 0.0;
+   ent_diss_order = 1;
    
-   ent_diss_order = 1; 
-   
+   time_scheme = SSPRK3;
    recon_scheme = FIRST;
-   
-   if(flux_scheme == KEPSSENT && ent_diss_order == 2 && recon_scheme != FIRST)
-   {
-      cout<<"Can only use FIRST order reconstruction option with TECNO scheme"<<endl;
-      exit(0);
-   }          
+   rtol = 0.0;
+   atol = 1.0e-8;
+
+   output_format = DAT;
+   output_single = false;
+   output_stride = 1;
    
    alpha = 0.0/1.0; 
    beta_upwind = 0.0/6.0; 
 
-   test_case = 11;
    max_iter = 10000000;
 
+   set_test_case ();
+}
+
+//------------------------------------------------------------------------------
+// Grid, time step and initial condition of the test case
+//------------------------------------------------------------------------------
+void FVProblem::set_test_case ()
+{
    if(test_case == 1)
    {
       // Sod shock tube case
@@ -862,9 +932,6 @@ FVProblem::FVProblem ()
       exit(0);
    }
 
-   prim_left.resize (n_var);
-   prim_right.resize (n_var);
-
    prim_left[0] = d_left;
    prim_left[1] = u_left;
    prim_left[2] = p_left;
@@ -875,12 +942,139 @@ FVProblem::FVProblem ()
    
 }
 
+//------------------------------------------------------------------------------
+// Change one parameter. Setting test_case resets n_cell, cfl, final_time and
+// itermod to the values of that test case, so it must come before them.
+//------------------------------------------------------------------------------
+void FVProblem::set_parameter (const string& param, const string& value)
+{
+   if(param == "test_case")
+   {
+      test_case = atoi(value.c_str());
+      set_test_case ();
+   }
+   else if(param == "time_scheme")
+   {
+      if(value == "RK1")
+         time_scheme = RK1;
+      else if(value == "SSPRK3")
+         time_scheme = SSPRK3;
+      else if(value == "JAMESON_RK4")
+         time_scheme = JAMESON_RK4;
+      else if(value == "LSRK3")
+         time_scheme = LSRK3;
+      else if(value == "LSRK4")
+         time_scheme = LSRK4;
+      else
+      {
+         cout<<"Unknown time integration scheme "<<value<<endl;
+         cout<<"Possible options: RK1, SSPRK3, JAMESON_RK4, LSRK3, LSRK4"<<endl;
+         exit(0);
+      }
+   }
+   else if(param == "flux_scheme")
+   {
+      if(value == "KEPSSENT")
+         flux_scheme = KEPSSENT;
+      else if(value == "ROE")
+         flux_scheme = ROE;
+      else if(value == "ROEFIXED")
+         flux_scheme = ROEFIXED;
+      else if(value == "RUSANOV")
+         flux_scheme = RUSANOV;
+      else
+      {
+         cout<<"Unknown flux scheme "<<value<<endl;
+         cout<<"Possible options: KEPSSENT, ROE, ROEFIXED, RUSANOV"<<endl;
+         exit(0);
+      }
+   }
+   else if(param == "recon_scheme")
+   {
+      if(value == "FIRST")
+         recon_scheme = FIRST;
+      else if(value == "MINMOD")
+         recon_scheme = MINMOD;
+      else if(value == "VANLEER")
+         recon_scheme = VANLEER;
+      else if(value == "WENO")
+         recon_scheme = WENO;
+      else
+      {
+         cout<<"Unknown type of variable reconstruction "<<value<<endl;
+         cout<<"Possible options FIRST, MINMOD, VANLEER, WENO"<<endl;
+         exit(0);
+      }
+   }
+   else if(param == "kepes_diss")
+      kepes_diss = atof(value.c_str());
+   else if(param == "ent_diss_order")
+      ent_diss_order = atoi(value.c_str());
+   else if(param == "n_cell")
+      n_cell = atoi(value.c_str());
+   else if(param == "cfl")
+      cfl = atof(value.c_str());
+   else if(param == "final_time")
+      final_time = atof(value.c_str());
+   else if(param == "itermod")
+      itermod = atoi(value.c_str());
+   else if(param == "max_iter")
+      max_iter = atoi(value.c_str());
+   else if(param == "output_format")
+   {
+      if(value == "DAT")
+         output_format = DAT;
+      else if(value == "BIN")
+         output_format = BIN;
+      else
+      {
+         cout<<"Unknown output format "<<value<<endl;
+         cout<<"Possible options: DAT, BIN"<<endl;
+         exit(0);
+      }
+   }
+   else if(param == "output_single")
+      output_single = atoi(value.c_str()) != 0;
+   else if(param == "output_stride")
+      output_stride = max(1, atoi(value.c_str()));
+   else if(param == "rtol")
+      rtol = atof(value.c_str());
+   else if(param == "atol")
+      atol = atof(value.c_str());
+   else
+   {
+      cout<<"Unknown parameter "<<param<<endl;
+      exit(0);
+   }
+}
+
+//------------------------------------------------------------------------------
+// Read parameters from file, one "name value" pair per line, see set_parameter
+//------------------------------------------------------------------------------
+void FVProblem::read_parameters (const char *param_file)
+{
+   if(verbose) cout << "Reading parameters from file " << param_file << endl;
+
+   ifstream fp(param_file);
+   if(!fp.is_open())
+   {
+      cout << "Could not open " << param_file << endl;
+      exit(0);
+   }
+
+   string param, value;
+   while(fp >> param >> value)
+      set_parameter (param, value);
+
+   fp.close();
+}
+
 //------------------------------------------------------------------------------
 // Allocate memory for grid and create grid
 //------------------------------------------------------------------------------
 void FVProblem::make_grid_and_dofs ()
 {
-   cout << "Making grid and allocating memory ...\n";
+   if(verbose) cout << "Making grid and allocating memory ...\n";
    
    n_face = n_cell + 1;
    dx = (xmax - xmin) / n_cell;
@@ -893,15 +1087,13 @@ void FVProblem::make_grid_and_dofs ()
    for(unsigned int i=0; i<n_cell; ++i)
       xc[i] = 0.5 * (xf[i] + xf[i+1]);
    
-   primitive.resize (n_cell, vector<double>(n_var));
-   primitive_old.resize (n_cell, vector<double>(n_var));
-   residual.resize (n_cell, vector<double>(n_var));
-   conserved.resize (n_cell, vector<double>(n_var));
-   conserved_old.resize (n_cell, vector<double>(n_var));
-   conl.resize (n_cell, vector<double>(n_var));
-   conr.resize (n_cell, vector<double>(n_var));
-
-   res_norm.resize (n_var);
+   primitive.resize (n_cell);
+   residual.resize (n_cell);
+   conserved.resize (n_cell);
+   conserved_old.resize (n_cell);
+   conl.resize (n_cell);
+   conr.resize (n_cell);
+   face_flux.resize (n_face);
 }
 
 //------------------------------------------------------------------------------
@@ -909,7 +1101,7 @@ void FVProblem::make_grid_and_dofs ()
 //------------------------------------------------------------------------------
 void FVProblem::initial_condition ()
 {
-   cout << "Setting initial conditions ...\n";
+   if(verbose) cout << "Setting initial conditions ...\n";
    
    // Set initial condition
    for(unsigned int i=0; i<n_cell; ++i)
@@ -962,7 +1154,7 @@ void FVProblem::compute_dt ()
 //------------------------------------------------------------------------------
 // Convert conserved to primitive
 //------------------------------------------------------------------------------
-void con2prim (vector<double>& con, vector<double>& prim)
+void FVProblem::con2prim (const State& con, State& prim) const
 {
    prim[0] = con[0];
    prim[1] = con[1]/con[0];
@@ -974,6 +1166,7 @@ void con2prim (vector<double>& con, vector<double>& prim)
 //------------------------------------------------------------------------------
 void FVProblem::con_to_prim ()
 {
+#pragma omp parallel for if(n_cell >= OMP_MIN_CELLS)
    for(unsigned int i=0; i<n_cell; ++i)
    {
       primitive[i][0] = conserved[i][0];
@@ -986,16 +1179,17 @@ void FVProblem::con_to_prim ()
 //------------------------------------------------------------------------------
 // Reconstruct left/right state at a face
 //------------------------------------------------------------------------------
+template <ReconstructionScheme recon>
 void FVProblem::reconstruct (const unsigned int face,
-                             vector<double>& left,
-                             vector<double>& right) const
+                             State& left,
+                             State& right) const
 {
-   if(recon_scheme == FIRST)
+   if(recon == FIRST)
    {
       left = primitive[face-1];
       right= primitive[face];
    }
-   else if(recon_scheme == MINMOD || recon_scheme == VANLEER)
+   else if(recon == MINMOD || recon == VANLEER)
    {
       if(face==1)
       {
@@ -1014,9 +1208,9 @@ void FVProblem::reconstruct (const unsigned int face,
          right = muscl (primitive[face+1], primitive[face], primitive[face-1]);
       }
    }
-   else if(recon_scheme == WENO)
+   else if(recon == WENO)
    {
-      vector<double> cl(n_var), cr(n_var);
+      State cl, cr;
       for(unsigned int j=0; j<n_var; ++j)
       {
          cl[j] = weno5(conval(face-3,j), 
@@ -1047,11 +1241,11 @@ void FVProblem::reconstruct (const unsigned int face,
 // exactly entropy consistent
 //------------------------------------------------------------------------------
 void FVProblem::keps2_ent_flux(const int& f,
-                                const vector<double>& left,
-                               const vector<double>& right,
-                               vector<double>& flux) const
+                                const State& left,
+                               const State& right,
+                               State& flux) const
 {   
-   vector<double> left_m1(n_var), right_p1(n_var), right_p2(n_var);
+   State left_m1, right_p1, right_p2;
    if(f==0)
    {
       left_m1  = prim_left;
@@ -1147,14 +1341,14 @@ void FVProblem::keps2_ent_flux(const int& f,
 // Entropy variable matrix dissipation flux
 // We use kepes_rusanov_roe hybrid dissipation if kep_rus_roe_hyb = 1
 //------------------------------------------------------------------------------
-void FVProblem::ent_diss_flux(const vector<double>& left,
-                              const vector<double>& right,
+void FVProblem::ent_diss_flux(const State& left,
+                              const State& right,
                               double rho,
                               double u,
                               double a,
                               double betal,
                               double betar,
-                              vector<double>& flux) const
+                              State& flux) const
 {
    // Add entropy dissipation
    //double a = sqrt(0.5 * GAMMA / beta);
@@ -1226,11 +1420,11 @@ void FVProblem::ent_diss_flux(const vector<double>& left,
 // Entropy variable matrix dissipation flux 2nd order
 // We use kepes_rusanov_roe hybrid dissipation if kep_rus_roe_hyb = 1
 //------------------------------------------------------------------------------
-void FVProblem::ent_diss_flux_2(const vector<double>& left_m1,
-                              const vector<double>& left,
-                              const vector<double>& right,
-                              const vector<double>& right_p1,
-                              const vector<double>& right_p2,
+void FVProblem::ent_diss_flux_2(const State& left_m1,
+                              const State& left,
+                              const State& right,
+                              const State& right_p1,
+                              const State& right_p2,
                               double rho_m1,
                               double u_m1,
                               double a_m1,
@@ -1246,7 +1440,7 @@ void FVProblem::ent_diss_flux_2(const vector<double>& left_m1,
                               double a_p1,
                               double betal_p1,
                               double betar_p1,
-                              vector<double>& flux) const
+                              State& flux) const
 {
    // Add entropy dissipation
    //double a_m1 = sqrt(0.5 * GAMMA / beta_m1);
@@ -1376,9 +1570,9 @@ void FVProblem::ent_diss_flux_2(const vector<double>& left_m1,
 // Numerical flux function
 // Original Roe Scheme
 //------------------------------------------------------------------------------
-void FVProblem::roe_flux(const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>& flux) const
+void FVProblem::roe_flux(const State& left,
+                         const State& right,
+                         State& flux) const
 {   
    double fl  = sqrt(left[0]);
    double fr  = sqrt(right[0]);
@@ -1430,9 +1624,9 @@ void FVProblem::roe_flux(const vector<double>& left,
 //------------------------------------------------------------------------------
 // Roe Scheme with entropy fix
 //------------------------------------------------------------------------------
-void FVProblem::roe_fixed_flux(const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>& flux) const
+void FVProblem::roe_fixed_flux(const State& left,
+                         const State& right,
+                         State& flux) const
 {   
    double fl  = sqrt(left[0]);
    double fr  = sqrt(right[0]);
@@ -1497,9 +1691,9 @@ void FVProblem::roe_fixed_flux(const vector<double>& left,
 // Numerical flux function
 // Rusanov Scheme
 //------------------------------------------------------------------------------
-void FVProblem::rusanov_flux(const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>& flux) const
+void FVProblem::rusanov_flux(const State& left,
+                         const State& right,
+                         State& flux) const
 {   
    double fl  = sqrt(left[0]);
    double fr  = sqrt(right[0]);
@@ -1553,13 +1747,14 @@ void FVProblem::rusanov_flux(const vector<double>& left,
 //------------------------------------------------------------------------------
 // Numerical flux function
 //------------------------------------------------------------------------------
+template <FluxScheme flux_type>
 void FVProblem::num_flux(const int&            f,
-                         const vector<double>& left,
-                         const vector<double>& right,
-                         vector<double>&       flux) const
+                         const State& left,
+                         const State& right,
+                         State&       flux) const
 {
    
-   switch(flux_scheme)
+   switch(flux_type)
    {
          case KEPSSENT:
             keps2_ent_flux(f, left,right,flux);
@@ -1579,41 +1774,40 @@ void FVProblem::num_flux(const int&            f,
 }
 
 //------------------------------------------------------------------------------
-// Compute finite volume residual
+// Compute finite volume residual. There is one instance for each flux and
+// reconstruction scheme, in which the choice of scheme at every face is made
+// by the compiler; init picks the one to use.
+// The fluxes of all faces are computed first and then differenced in each
+// cell, so that both loops can be divided among threads. The residual is
+// the same as when adding the fluxes face by face, flux[i+1] - flux[i].
 //------------------------------------------------------------------------------
+template <FluxScheme flux_type, ReconstructionScheme recon>
 void FVProblem::compute_residual ()
 {
-   for(unsigned int i=0; i<n_cell; ++i)
-   {   for(unsigned int j=0; j<n_var; ++j)
-         residual[i][j] = 0.0;
-   }
-   
-   vector<double> flux (n_var);
-   vector<double> left (n_var);
-   vector<double> right(n_var); 
-   
-   // Flux through left boundary
-   num_flux (0, prim_left, primitive[0], flux);
-   for(unsigned int j=0; j<n_var; ++j)
-      residual[0][j] -= flux[j];
-      
-   // Flux through interior faces
-   for(unsigned int i=1; i<n_face-1; ++i)
+#pragma omp parallel if(n_cell >= OMP_MIN_CELLS)
    {
-      reconstruct (i, left, right);
-      num_flux (i, left, right, flux);
-      for(unsigned int j=0; j<n_var; ++j)
+      State left, right;
+
+#pragma omp for
+      for(unsigned int i=0; i<n_face; ++i)
       {
-         residual[i-1][j] += flux[j];
-         residual[i][j]   -= flux[j];           
+         if(i == 0) // left boundary
+            num_flux<flux_type> (0, prim_left, primitive[0], face_flux[0]);
+         else if(i == n_face-1) // right boundary
+            num_flux<flux_type> (i, primitive[n_cell-1], prim_right,
+                                 face_flux[i]);
+         else
+         {
+            reconstruct<recon> (i, left, right);
+            num_flux<flux_type> (i, left, right, face_flux[i]);
+         }
       }
-   }
 
-   // Flux through right boundary
-   num_flux (n_face-1, primitive[n_cell-1], prim_right, flux);
-   for(unsigned int j=0; j<n_var; ++j)
-       residual[n_cell-1][j] += flux[j];
-    
+#pragma omp for
+      for(unsigned int i=0; i<n_cell; ++i)
+         for(unsigned int j=0; j<n_var; ++j)
+            residual[i][j] = face_flux[i+1][j] - face_flux[i][j];
+   }
 }
 
 //------------------------------------------------------------------------------
@@ -1621,23 +1815,59 @@ void FVProblem::compute_residual ()
 //------------------------------------------------------------------------------
 void FVProblem::update_solution (const unsigned int rk)
 {
-   if (time_scheme == RK1 || time_scheme == SSPRK3)
+   if (time_scheme == SSPRK3 && rk == 2 && rtol > 0.0)
+   {
+      // Before the last stage, conserved is u^(2) and 2 u^(2) - u^n is the
+      // second order SSPRK2 solution; its difference to the third order one
+      // estimates the error.
+      double sum = 0.0;
+#pragma omp parallel for if(n_cell >= OMP_MIN_CELLS) reduction(+:sum)
+      for(unsigned int i=0; i<n_cell; ++i)
+         for(unsigned int j=0; j<n_var; ++j)
+         {
+            const double u2 = conserved[i][j];
+            conserved[i][j] = arks[rk] * conserved_old[i][j] +
+                              brks[rk] * (u2 - (dt/dx) * residual[i][j]);
+            const double err = conserved[i][j] - (2.0 * u2 - conserved_old[i][j]);
+            const double sc = atol + rtol * max(fabs(conserved_old[i][j]),
+                                                fabs(conserved[i][j]));
+            sum += (err/sc) * (err/sc);
+         }
+      err_norm = sqrt(sum / (n_cell * n_var));
+   }
+   else if (time_scheme == RK1 || time_scheme == SSPRK3)
+#pragma omp parallel for if(n_cell >= OMP_MIN_CELLS)
       for(unsigned int i=0; i<n_cell; ++i)
          for(unsigned int j=0; j<n_var; ++j)
             conserved[i][j] = arks[rk] * conserved_old[i][j] +
                               brks[rk] * (conserved[i][j] - (dt/dx) * residual[i][j]);
    else if (time_scheme == JAMESON_RK4)
+#pragma omp parallel for if(n_cell >= OMP_MIN_CELLS)
       for(unsigned int i=0; i<n_cell; ++i)
          for(unsigned int j=0; j<n_var; ++j)
             conserved[i][j] = conserved_old[i][j] +
                               jameson_rks[rk] * (- (dt/dx) * residual[i][j]);   
+   else
+   {
+      // conserved_old holds the second register du
+      const double a = (time_scheme == LSRK3) ? ls3a[rk] : ls4a[rk];
+      const double b = (time_scheme == LSRK3) ? ls3b[rk] : ls4b[rk];
+#pragma omp parallel for if(n_cell >= OMP_MIN_CELLS)
+      for(unsigned int i=0; i<n_cell; ++i)
+         for(unsigned int j=0; j<n_var; ++j)
+         {
+            const double du = - (dt/dx) * residual[i][j];
+            conserved_old[i][j] = (rk == 0) ? du : a * conserved_old[i][j] + du;
+            conserved[i][j] += b * conserved_old[i][j];
+         }
+   }
 }
 
 
 //------------------------------------------------------------------------------
 // Compute entropy
 //------------------------------------------------------------------------------
-double FVProblem::entropy(const vector<double>& prim_var) const  
+double FVProblem::entropy(const State& prim_var) const  
 {
    double s,eta;
    s = log(prim_var[2]) - GAMMA*log(prim_var[0]);
@@ -1651,24 +1881,21 @@ double FVProblem::entropy(const vector<double>& prim_var) const
 //------------------------------------------------------------------------------
 void FVProblem::output ()
 {
+   if(output_format == BIN)
+   {
+      output_bin ();
+      return;
+   }
+
    cout<<"Saving solutions in"<<endl;
    
 
    //cout<<"check1"<<endl;
    string filename1 = "sol";
    string extension1 = ".dat";
-   string precount;
-   if     (counter <= 9)    precount = "000";
-   else if(counter <= 99)   precount = "00";
-   else if(counter <= 999)  precount = "0";
-   else if(counter <= 9999) precount = "";
-   else
-   {
-      cout << "Writer::output: counter is too large !!!\n";
-   }
    
    stringstream ss;
-   ss <<precount<<counter;
+   ss << setw(4) << setfill('0') << counter;
    filename1 += ss.str();
    filename1 +=extension1;
       
@@ -1691,6 +1918,65 @@ void FVProblem::output ()
    counter++;
 }
 
+//------------------------------------------------------------------------------
+// Append the solution to the binary file sol.bin, in native byte order.
+// The first call writes the header
+//    char[8] "SOL1D", int n, output_stride, bytes per value, NVAR,
+//    double GAMMA, n x
+// for the n = ceil(n_cell/output_stride) cells that are saved, and every call
+// appends one snapshot
+//    int64 iter, double time, n x (density, velocity, pressure)
+// in float or double. Derived quantities are left to the reader, see
+// readsol.py.
+//------------------------------------------------------------------------------
+void FVProblem::output_bin ()
+{
+   const unsigned int n = (n_cell + output_stride - 1) / output_stride;
+   ofstream fo;
+
+   if(counter == 0)
+   {
+      fo.open ("sol.bin", ios::binary | ios::trunc);
+      const char magic[8] = "SOL1D";
+      const int ihead[] = { (int)n, (int)output_stride,
+                            output_single ? (int)sizeof(float) : (int)sizeof(double),
+                            NVAR };
+      fo.write (magic, sizeof(magic));
+      fo.write ((const char*)ihead, sizeof(ihead));
+      fo.write ((const char*)&GAMMA, sizeof(double));
+      for(unsigned int i=0; i<n_cell; i+=output_stride)
+         fo.write ((const char*)&xc[i], sizeof(double));
+      if(output_single)
+         obuf_f.resize (n * NVAR);
+      else
+         obuf_d.resize (n * NVAR);
+   }
+   else
+      fo.open ("sol.bin", ios::binary | ios::app);
+
+   const long long iter_out = iter;
+   fo.write ((const char*)&iter_out, sizeof(iter_out));
+   fo.write ((const char*)&time, sizeof(double));
+   if(output_single)
+   {
+      for(unsigned int i=0, k=0; i<n_cell; i+=output_stride)
+         for(unsigned int j=0; j<NVAR; ++j)
+            obuf_f[k++] = primitive[i][j];
+      fo.write ((const char*)obuf_f.data(), obuf_f.size() * sizeof(float));
+   }
+   else
+   {
+      for(unsigned int i=0, k=0; i<n_cell; i+=output_stride)
+         for(unsigned int j=0; j<NVAR; ++j)
+            obuf_d[k++] = primitive[i][j];
+      fo.write ((const char*)obuf_d.data(), obuf_d.size() * sizeof(double));
+   }
+   fo.close ();
+
+   if(verbose) cout << "Saved solution " << counter << " to sol.bin" << endl;
+   counter++;
+}
+
 
 //------------------------------------------------------------------------------
 // compute norm of residual
@@ -1712,32 +1998,125 @@ void FVProblem::compute_residual_norm ()
 }
 
 //------------------------------------------------------------------------------
-// Start the computations
+// Set up the grid and the initial condition
 //------------------------------------------------------------------------------
-void FVProblem::run ()
+void FVProblem::init ()
 {
+   #define RESIDUALS(flux) { &FVProblem::compute_residual<flux, FIRST>,   \
+                             &FVProblem::compute_residual<flux, MINMOD>,  \
+                             &FVProblem::compute_residual<flux, VANLEER>, \
+                             &FVProblem::compute_residual<flux, WENO> }
+   static const Residual residuals[][4] = { RESIDUALS(KEPSSENT),
+                                            RESIDUALS(ROE),
+                                            RESIDUALS(ROEFIXED),
+                                            RESIDUALS(RUSANOV) };
+   #undef RESIDUALS
+
+   if(flux_scheme == KEPSSENT && ent_diss_order == 2 && recon_scheme != FIRST)
+   {
+      cout<<"Can only use FIRST order reconstruction option with TECNO scheme"<<endl;
+      exit(0);
+   }
+   compute_residual_fn = residuals[flux_scheme][recon_scheme];
+
+   if(time_scheme == RK1)
+      nrk = 1;
+   else if(time_scheme == SSPRK3 || time_scheme == LSRK3)
+      nrk = 3;
+   else if(time_scheme == JAMESON_RK4)
+      nrk = 4;
+   else
+      nrk = 5;
+
+   if(rtol > 0.0 && time_scheme != SSPRK3)
+   {
+      cout<<"Adaptive time step (rtol > 0) needs time_scheme SSPRK3"<<endl;
+      exit(0);
+   }
+   dt_next = 1.0e20;
+   err_norm = 0.0;
+   n_residual = 0;
+   n_reject = 0;
+
    make_grid_and_dofs ();
    initial_condition ();
    con_to_prim ();
    counter = 0;
-   output();
-   double time = 0.0;
-   unsigned int iter = 0;
-   while (time < final_time && iter < max_iter)
-   {
+   time = 0.0;
+   iter = 0;
+   if(verbose) output();
+}
+
+//------------------------------------------------------------------------------
+// Advance by one time step
+//------------------------------------------------------------------------------
+void FVProblem::step ()
+{
+   if(time_scheme != LSRK3 && time_scheme != LSRK4)
       conserved_old = conserved;
-      primitive_old = primitive;
-      compute_dt ();
-      if(time+dt > final_time) dt = final_time - time;
-      for(unsigned int rk=0; rk<nrk; ++rk)
+   compute_dt ();
+   if(rtol > 0.0) dt = min(dt, dt_next);
+   if(time+dt > final_time) dt = final_time - time;
+   stages ();
+
+   if(rtol > 0.0)
+   {
+      // Redo the step with a smaller dt while the error is too large; a NaN
+      // error is also rejected and then dt is cut by the largest factor
+      unsigned int n_retry = 0;
+      while(!(err_norm <= 1.0))
       {
-         compute_residual ();
-         update_solution (rk);
+         ++n_reject;
+         ++n_retry;
+         conserved = conserved_old;
          con_to_prim ();
+         dt *= (err_norm > 1.0) ? max(0.2, 0.9 * pow(err_norm, -1.0/3.0)) : 0.2;
+         if(n_retry > MAX_REJECT || dt < DT_MIN_REL * final_time)
+         {
+            cout << "Adaptive time step failed at time = " << time
+                 << ": " << n_retry << " rejections, dt = " << dt
+                 << ", error/tolerance = " << err_norm << endl;
+            exit(1);
+         }
+         stages ();
       }
-      time += dt;
-      ++iter;
-      compute_residual_norm();
+      dt_next = dt * min(5.0, max(0.2, 0.9 * pow(err_norm, -1.0/3.0)));
+   }
+
+   time += dt;
+   ++iter;
+   compute_residual_norm();
+}
+
+//------------------------------------------------------------------------------
+// Stages of the Runge-Kutta scheme from time to time + dt
+//------------------------------------------------------------------------------
+void FVProblem::stages ()
+{
+   for(unsigned int rk=0; rk<nrk; ++rk)
+   {
+      (this->*compute_residual_fn) ();
+      update_solution (rk);
+      con_to_prim ();
+   }
+   n_residual += nrk;
+}
+
+//------------------------------------------------------------------------------
+// Start the computations
+//------------------------------------------------------------------------------
+void FVProblem::run ()
+{
+   init ();
+   double step_time = 0.0;       // wall time of the time steps, without output
+   unsigned long step_alloc = 0; // heap allocations in the time steps
+   while (!done())
+   {
+      const unsigned long alloc0 = n_alloc;
+      const auto t0 = chrono::steady_clock::now();
+      step ();
+      step_time += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+      step_alloc += n_alloc - alloc0;
       //cout << "Iter = " << iter <<" Time = "<<time<<endl;
 
 
@@ -1751,15 +2130,132 @@ void FVProblem::run ()
       }
    }
 
+   cout << "Time steps = " << iter << ", cells/s = " << n_cell * iter / step_time
+        << ", heap allocations in time steps = " << step_alloc << endl;
+   cout << "Residual evaluations = " << n_residual
+        << ", rejected steps = " << n_reject << endl;
+
+}
+
+//------------------------------------------------------------------------------
+// Append the solution to a binary ensemble file: int test_case, flux_scheme,
+// ent_diss_order, n_cell, iter; double kepes_diss, time; then for each cell
+// double x, density, velocity, pressure.
+//------------------------------------------------------------------------------
+void FVProblem::write (ofstream& fo) const
+{
+   const int ihead[] = { test_case, flux_scheme, ent_diss_order, (int)n_cell,
+                         (int)iter };
+   const double dhead[] = { kepes_diss, time };
+   fo.write ((const char*)ihead, sizeof(ihead));
+   fo.write ((const char*)dhead, sizeof(dhead));
+   for(unsigned int i=0; i<n_cell; ++i)
+   {
+      fo.write ((const char*)&xc[i], sizeof(double));
+      fo.write ((const char*)primitive[i].data(), NVAR*sizeof(double));
+   }
+}
+
+//------------------------------------------------------------------------------
+// Run an ensemble of problems given in param_file, one member per line with
+// the parameters in which it differs from the default, see set_parameter:
+//    test_case 11 flux_scheme KEPSSENT kepes_diss 0.0 ent_diss_order 1
+// The members are independent and are divided among the OpenMP threads, each
+// thread advancing its members to their final times; since the members can
+// need very different numbers of time steps, the threads take one member at a
+// time. No sol*.dat files are written, the final solutions of all members are
+// written in their order to one binary file out_file, see FVProblem::write.
+//------------------------------------------------------------------------------
+void run_ensemble (const char *param_file, const char *out_file)
+{
+   cout << "Reading ensemble from file " << param_file << endl;
+   ifstream fp(param_file);
+   if(!fp.is_open())
+   {
+      cout << "Could not open " << param_file << endl;
+      exit(0);
+   }
+
+   vector<FVProblem> members;
+   string line, param, value;
+   while(getline(fp, line))
+   {
+      istringstream ss(line);
+      if(!(ss >> param >> value)) continue;
+      members.push_back (FVProblem());
+      members.back().verbose = false;
+      do
+         members.back().set_parameter (param, value);
+      while(ss >> param >> value);
+   }
+   fp.close ();
+   const int n = members.size();
+   cout << "Number of members = " << n << endl;
+
+   unsigned long cells = 0;
+   const auto t0 = chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic) reduction(+:cells)
+   for(int m=0; m<n; ++m)
+   {
+      FVProblem& member = members[m];
+      member.init ();
+      while (!member.done())
+         member.step ();
+      cells += member.cells ();
+   }
+   const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+   cout << "Time = " << elapsed << " s, cells/s = " << cells / elapsed << endl;
 
+   ofstream fo(out_file, ios::binary);
+   for(int m=0; m<n; ++m)
+      members[m].write (fo);
+   fo.close ();
+   cout << "Wrote " << out_file << endl;
 }
 
 //------------------------------------------------------------------------------
 // This where it all starts
 //------------------------------------------------------------------------------
-int main ()
+int main (int argc, char *argv[])
 {
+   // ./runcode -logavg_check n : accuracy and speed of logavg on n pairs
+   if(argc == 3 && string(argv[1]) == "-logavg_check")
+   {
+      logavg_check(atoi(argv[2]));
+      return 0;
+   }
+
+   // ./runcode -ensemble file : run the ensemble in file, see run_ensemble
+   if(argc == 3 && string(argv[1]) == "-ensemble")
+   {
+      run_ensemble (argv[2], "ensemble.dat");
+      return 0;
+   }
+
+   // ./runcode [-param file] [-name value ...] : parameters from file and
+   // command line, in the order given, see FVProblem::set_parameter
+   if(argc % 2 == 0)
+   {
+      cout << "Expected -name value pairs, got a single " << argv[argc-1]
+           << endl;
+      cout << "Usage: " << argv[0] << " [-param file] [-name value ...]"
+           << endl;
+      exit(1);
+   }
    FVProblem fv_problem;
+   for(int i=1; i+1<argc; i+=2)
+   {
+      const string param = argv[i];
+      if(param[0] != '-')
+      {
+         cout << "Expected -name value, got " << param << endl;
+         exit(1);
+      }
+      if(param == "-param")
+         fv_problem.read_parameters (argv[i+1]);
+      else
+         fv_problem.set_parameter (param.substr(1), argv[i+1]);
+   }
    fv_problem.run ();
    
    return 0;
@@ -0,0 +1,39 @@
+"""
+Read sol.bin written with output_format BIN, see FVProblem::output_bin.
+   python readsol.py [sol.bin]
+writes each snapshot to solNNNN.dat with the same columns as output_format DAT
+   x, density, velocity, pressure, mach, enthalpy, entropy
+"""
+import sys
+import numpy as np
+
+def read(filename="sol.bin"):
+    with open(filename, "rb") as f:
+        f.read(8)
+        n, stride, prec, nvar = np.fromfile(f, dtype=np.int32, count=4)
+        gamma = np.fromfile(f, dtype=np.float64, count=1)[0]
+        x = np.fromfile(f, dtype=np.float64, count=n)
+        real = np.float32 if prec == 4 else np.float64
+        snap = np.dtype([("iter", np.int64), ("time", np.float64),
+                         ("prim", real, (n, nvar))])
+        data = np.fromfile(f, dtype=snap)
+    return gamma, x, data
+
+# Mach number, total enthalpy and entropy from density, velocity, pressure
+def derived(gamma, prim):
+    rho, u, p = prim[:,0], prim[:,1], prim[:,2]
+    sonic = np.sqrt(gamma * p / rho)
+    mach = u / sonic
+    H = sonic**2 / (gamma - 1.0) + 0.5 * u**2
+    s = np.log(p) - gamma * np.log(rho)
+    return mach, H, s
+
+if __name__ == "__main__":
+    filename = sys.argv[1] if len(sys.argv) > 1 else "sol.bin"
+    gamma, x, data = read(filename)
+    for c, d in enumerate(data):
+        prim = d["prim"].astype(np.float64)
+        mach, H, s = derived(gamma, prim)
+        np.savetxt("sol%04d.dat" % c,
+                   np.column_stack((x, prim, mach, H, s)))
+        print("iter = %d, time = %g, saved sol%04d.dat" % (d["iter"], d["time"], c))
@@ -5,6 +5,10 @@
 
 #define SIGN(a) (((a)<0) ? -1:1)
 
+// With OpenMP (g++ -fopenmp), loops over cells and faces use several threads
+// from this size
+#define OMP_MIN_CELLS 10000
+
 const double Pr    = 2.0/3.0;
 const double arks[] = {0.0, 3.0/4.0, 1.0/3.0};
 const double brks[] = {1.0, 1.0/4.0, 2.0/3.0};
@@ -141,6 +145,7 @@ class FVProblem
       vector<double> xf;
    
       vector< vector<double> > primitive;
+      vector< vector<double> > face_flux;
       vector< vector<double> > residual;
       vector< vector<double> > conserved;
       vector< vector<double> > conserved_old;
@@ -241,6 +246,7 @@ void FVProblem::make_grid_and_dofs ()
       xc[i] = 0.5 * (xf[i] + xf[i+1]);
    
    primitive.resize (n_cell, vector<double>(n_var));
+   face_flux.resize (n_face, vector<double>(n_var));
    residual.resize (n_cell, vector<double>(n_var));
    conserved.resize (n_cell, vector<double>(n_var));
    conserved_old.resize (n_cell, vector<double>(n_var));
@@ -468,43 +474,41 @@ void FVProblem::num_flux(const vector<double>& left,
 }
 
 //------------------------------------------------------------------------------
-// Compute finite volume residual
+// Compute finite volume residual. The fluxes of all faces are computed first
+// and then differenced in each cell, so that both loops can be divided among
+// threads.
 //------------------------------------------------------------------------------
 void FVProblem::compute_residual ()
 {
-   for(unsigned int i=0; i<n_cell; ++i)
-      for(unsigned int j=0; j<n_var; ++j)
-         residual[i][j] = 0.0;
-   
-   vector<double> flux (n_var);
-   vector<double> left (n_var);
-   vector<double> right(n_var);
-   
-   // Flux through left boundary
-   num_flux (prim_left, primitive[0], 
-             tau_f[0], tau_f[0], 
-             q_f[0], q_f[0], flux);
-   for(unsigned int j=0; j<n_var; ++j)
-      residual[0][j] -= flux[j];
-
-   // Flux through interior faces
-   for(unsigned int i=1; i<n_face-1; ++i)
+#pragma omp parallel if(n_cell >= OMP_MIN_CELLS)
    {
-      reconstruct (i, left, right);
-      num_flux (left, right, tau_f[i], tau_f[i], q_f[i], q_f[i], flux);
-      for(unsigned int j=0; j<n_var; ++j)
+      vector<double> left (n_var);
+      vector<double> right(n_var);
+
+#pragma omp for
+      for(unsigned int i=0; i<n_face; ++i)
       {
-         residual[i-1][j] += flux[j];
-         residual[i][j]   -= flux[j];
+         if(i == 0) // left boundary
+            num_flux (prim_left, primitive[0],
+                      tau_f[0], tau_f[0],
+                      q_f[0], q_f[0], face_flux[0]);
+         else if(i == n_face-1) // right boundary
+            num_flux (primitive[n_cell-1], prim_right,
+                      tau_f[i], tau_f[i],
+                      q_f[i], q_f[i], face_flux[i]);
+         else
+         {
+            reconstruct (i, left, right);
+            num_flux (left, right, tau_f[i], tau_f[i], q_f[i], q_f[i],
+                      face_flux[i]);
+         }
       }
-   }
 
-   // Flux through right boundary
-   num_flux (primitive[n_cell-1], prim_right, 
-             tau_f[n_face-1], tau_f[n_face-1], 
-             q_f[n_face-1], q_f[n_face-1], flux);
-   for(unsigned int j=0; j<n_var; ++j)
-      residual[n_cell-1][j] += flux[j];
+#pragma omp for
+      for(unsigned int i=0; i<n_cell; ++i)
+         for(unsigned int j=0; j<n_var; ++j)
+            residual[i][j] = face_flux[i+1][j] - face_flux[i][j];
+   }
 }
 
 //------------------------------------------------------------------------------
@@ -512,6 +516,7 @@ void FVProblem::compute_residual ()
 //------------------------------------------------------------------------------
 void FVProblem::update_solution (const unsigned int rk)
 {
+#pragma omp parallel for if(n_cell >= OMP_MIN_CELLS)
    for(unsigned int i=0; i<n_cell; ++i)
       for(unsigned int j=0; j<n_var; ++j)
          conserved[i][j] = arks[rk] * conserved_old[i][j] +
@@ -1,6 +1,8 @@
 /*
  Compile as
      g++ main.cc
+ or, to use several threads on large grids,
+     g++ -fopenmp main.cc
  Run the program by specifying input file
      ./a.out test.in
 */
@@ -16,6 +18,9 @@
 const double arks[] = {0.0, 3.0/4.0, 1.0/3.0};
 const double brks[] = {1.0, 1.0/4.0, 2.0/3.0};
 
+// With OpenMP, loops over cells and faces use several threads from this size
+#define OMP_MIN_CELLS 10000
+
 enum FluxScheme { roe, godunov };
 enum ReconstructScheme { first, muscl_minmod, muscl_vanleer };
 
@@ -126,6 +131,7 @@ class FVProblem
       vector<double> xc;
       vector<double> xf;
    
+      vector<double> face_flux;
       vector<double> residual;
       vector<double> conserved;
       vector<double> conserved_old;
@@ -189,6 +195,7 @@ void FVProblem::make_grid_and_dofs ()
    for(unsigned int i=0; i<n_cell; ++i)
       xc[i] = 0.5 * (xf[i] + xf[i+1]);
    
+   face_flux.resize (n_face);
    residual.resize (n_cell);
    conserved.resize (n_cell);
    conserved_old.resize (n_cell);
@@ -280,32 +287,34 @@ void FVProblem::num_flux(const double left,
 }
 
 //------------------------------------------------------------------------------
-// Compute finite volume residual
+// Compute finite volume residual. The fluxes of all faces are computed first
+// and then differenced in each cell, so that both loops can be divided among
+// threads.
 //------------------------------------------------------------------------------
 void FVProblem::compute_residual ()
 {
-   for(unsigned int i=0; i<n_cell; ++i)
-      residual[i] = 0.0;
-   
-   double flux, left, right;
-   
-   // Flux through left boundary
-   num_flux (u_left, conserved[0], flux);
-   residual[0] -= flux;
-
-   // Flux through interior faces
-   for(unsigned int i=1; i<n_face-1; ++i)
+#pragma omp parallel if(n_cell >= OMP_MIN_CELLS)
    {
-      reconstruct (i, left, right);
-      num_flux (left, right, flux);
-      
-      residual[i-1] += flux;
-      residual[i]   -= flux;
-   }
+      double left, right;
 
-   // Flux through right boundary
-   num_flux (conserved[n_cell-1], u_right, flux);
-   residual[n_cell-1] += flux;
+#pragma omp for
+      for(unsigned int i=0; i<n_face; ++i)
+      {
+         if(i == 0) // left boundary
+            num_flux (u_left, conserved[0], face_flux[0]);
+         else if(i == n_face-1) // right boundary
+            num_flux (conserved[n_cell-1], u_right, face_flux[i]);
+         else
+         {
+            reconstruct (i, left, right);
+            num_flux (left, right, face_flux[i]);
+         }
+      }
+
+#pragma omp for
+      for(unsigned int i=0; i<n_cell; ++i)
+         residual[i] = face_flux[i+1] - face_flux[i];
+   }
 }
 
 //------------------------------------------------------------------------------
@@ -313,6 +322,7 @@ void FVProblem::compute_residual ()
 //------------------------------------------------------------------------------
 void FVProblem::update_solution (const unsigned int rk)
 {
+#pragma omp parallel for if(n_cell >= OMP_MIN_CELLS)
    for(unsigned int i=0; i<n_cell; ++i)
          conserved[i] = arks[rk] * conserved_old[i] +
             brks[rk] * (conserved[i] - (dt/dx) * residual[i]);
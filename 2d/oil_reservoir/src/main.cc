@@ -14,9 +14,6 @@ unsigned int Permeability::N;
 std::vector<double> Permeability::xl;
 std::vector<double> Permeability::yl;
 
-// counter to count how many times the flux has an interior minimum
-int n_interior_min;
-
 using namespace std;
 
 int main ()
@@ -8,6 +8,7 @@ Matrix::Matrix ()
 {
    nrow = 0;
    ncol = 0;
+   data = 0;
 }
 
 // constructor
@@ -21,126 +22,93 @@ Matrix::Matrix (const unsigned int nrow, const unsigned int ncol)
    data = new double [nrow*ncol];
 }
 
-unsigned int Matrix::index (const unsigned int i, const unsigned int j)
+// copy constructor
+Matrix::Matrix (const Matrix& mat)
+   :
+   nrow (mat.nrow),
+   ncol (mat.ncol)
 {
-   return i + nrow * j;
+   data = 0;
+   if(nrow*ncol > 0)
+   {
+      data = new double [nrow*ncol];
+      unsigned int n = nrow * ncol;
+      for(unsigned int i=0; i<n; ++i)
+         data[i] = mat.data[i];
+   }
 }
 
-// assign one matrix to another
-Matrix& Matrix::operator= (const Matrix& rhs)
+// move constructor: take over the memory of mat
+Matrix::Matrix (Matrix&& mat)
+   :
+   nrow (mat.nrow),
+   ncol (mat.ncol),
+   data (mat.data)
 {
-
-   assert (nrow == rhs.nrow);
-   assert (ncol == rhs.ncol);
-
-   unsigned int n = nrow * ncol;
-   for(unsigned int i=0; i<n; ++i)
-      data[i] = rhs.data[i];
-   
-   return *this;
+   mat.nrow = 0;
+   mat.ncol = 0;
+   mat.data = 0;
 }
 
-// assign one matrix to scalar
-Matrix& Matrix::operator= (const double scalar)
-{
-
-   assert (nrow > 0);
-   assert (ncol > 0);
-
-   unsigned int n = nrow * ncol;
-   for(unsigned int i=0; i<n; ++i)
-      data[i] = scalar;
-   
-   return *this;
-}
-
-// add two matrices: result = this + mat2
-Matrix Matrix::operator+ (const Matrix& mat2) const
+unsigned int Matrix::index (const unsigned int i, const unsigned int j)
 {
-
-   assert (nrow == mat2.nrow);
-   assert (ncol == mat2.ncol);
-
-   Matrix result (nrow, ncol);
-
-   unsigned int n = nrow * ncol;
-   for(unsigned int i=0; i<n; ++i)
-      result.data[i] = data[i] + mat2.data[i];
-   
-   return result;
+   return i + nrow * j;
 }
 
-// add two matrices: this = this + mat2
-Matrix& Matrix::operator+= (const Matrix& mat2)
+// assign one matrix to another; if the sizes differ, this takes the size of rhs
+Matrix& Matrix::operator= (const Matrix& rhs)
 {
 
-   assert (nrow == mat2.nrow);
-   assert (ncol == mat2.ncol);
+   if(nrow != rhs.nrow || ncol != rhs.ncol)
+   {
+      if(nrow*ncol > 0)
+         delete [] data;
+      nrow = rhs.nrow;
+      ncol = rhs.ncol;
+      data = 0;
+      if(nrow*ncol > 0)
+         data = new double [nrow*ncol];
+   }
 
    unsigned int n = nrow * ncol;
    for(unsigned int i=0; i<n; ++i)
-      data[i] += mat2.data[i];
+      data[i] = rhs.data[i];
    
    return *this;
 }
 
-// subtract two matrices: result = this - mat2
-Matrix Matrix::operator- (const Matrix& mat2) const
+// move one matrix to another: free the old memory, take over that of mat
+Matrix& Matrix::operator= (Matrix&& mat)
 {
+   if(this == &mat)
+      return *this;
 
-   assert (nrow == mat2.nrow);
-   assert (ncol == mat2.ncol);
-
-   Matrix result (nrow, ncol);
-
-   unsigned int n = nrow * ncol;
-   for(unsigned int i=0; i<n; ++i)
-      result.data[i] = data[i] - mat2.data[i];
-   
-   return result;
-}
-
-// multiply two matrices element by element: result = this * mat2
-Matrix Matrix::operator* (const Matrix& mat2) const
-{
-
-   assert (nrow == mat2.nrow);
-   assert (ncol == mat2.ncol);
-
-   Matrix result (nrow, ncol);
-
-   unsigned int n = nrow * ncol;
-   for(unsigned int i=0; i<n; ++i)
-      result.data[i] = data[i] * mat2.data[i];
-   
-   return result;
-}
+   if(nrow*ncol > 0)
+      delete [] data;
 
-// add two matrices: this = this - mat2
-Matrix& Matrix::operator-= (const Matrix& mat2)
-{
+   nrow = mat.nrow;
+   ncol = mat.ncol;
+   data = mat.data;
 
-   assert (nrow == mat2.nrow);
-   assert (ncol == mat2.ncol);
+   mat.nrow = 0;
+   mat.ncol = 0;
+   mat.data = 0;
 
-   unsigned int n = nrow * ncol;
-   for(unsigned int i=0; i<n; ++i)
-      data[i] -= mat2.data[i];
-   
    return *this;
 }
 
-// multiply matrix with scalar: result = this * scalar
-Matrix Matrix::operator* (const double scalar) const
+// assign one matrix to scalar
+Matrix& Matrix::operator= (const double scalar)
 {
 
-   Matrix result (nrow, ncol);
+   assert (nrow > 0);
+   assert (ncol > 0);
 
    unsigned int n = nrow * ncol;
    for(unsigned int i=0; i<n; ++i)
-      result.data[i] = scalar * data[i];
+      data[i] = scalar;
    
-   return result;
+   return *this;
 }
 
 // multiply matrix with scalar: this = this * scalar
@@ -161,18 +129,6 @@ Matrix::~Matrix ()
       delete [] data;
 }
 
-// access matrix element (i,j)
-double& Matrix::operator() (const unsigned int i, const unsigned int j) const
-{
-   return data[i + nrow*j];
-}
-
-// access matrix element (i,j)
-double& Matrix::operator() (const unsigned int i, const unsigned int j)
-{
-   return data[i + nrow*j];
-}
-
 // allocate memory for matrix which has already been declared
 void Matrix::allocate (const unsigned int ni, const unsigned int nj)
 {
@@ -185,7 +141,7 @@ void Matrix::allocate (const unsigned int ni, const unsigned int nj)
 }
 
 // dot product of two matrices, element-by-element
-double Matrix::dot (const Matrix &mat)
+double Matrix::dot (const Matrix &mat) const
 {
    assert (nrow == mat.nrow);
    assert (ncol == mat.ncol);
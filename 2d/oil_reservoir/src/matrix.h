@@ -1,24 +1,53 @@
 #ifndef __MATRIX_H__
 #define __MATRIX_H__
 
-class Matrix
+#include <cassert>
+
+// Arithmetic on matrices is element by element and lazy: a + b, a - b, a * b
+// and a * scalar only build a small expression object which refers to its
+// operands. The expression is evaluated when it is assigned to a Matrix, in
+// one loop and without temporary matrices, e.g.
+//    sc = sc_old * ark + (saturation * concentration - c_residual) * brk;
+// Every element of the result only depends on the same element of the
+// operands, so the result may also appear on the right hand side.
+template <class E>
+class MatrixExpr
+{
+   public:
+      const E& self () const { return static_cast<const E&>(*this); }
+      unsigned int rows () const { return self().rows(); }
+      unsigned int cols () const { return self().cols(); }
+      double operator[] (const unsigned int k) const { return self()[k]; }
+};
+
+class Matrix : public MatrixExpr<Matrix>
 {
    public:
       Matrix ();
       Matrix (const unsigned int nrow, const unsigned ncol);
+      Matrix (const Matrix&);
+      Matrix (Matrix&&);
+      template <class E> Matrix (const MatrixExpr<E>&);
       Matrix& operator= (const Matrix&);
+      Matrix& operator= (Matrix&&);
       Matrix& operator= (const double);
-      Matrix  operator+ (const Matrix&) const; // add two matrices
-      Matrix  operator- (const Matrix&) const; // subtract two matrices
-      Matrix  operator* (const Matrix&) const; // element-by-element multiply
+      template <class E> Matrix& operator=  (const MatrixExpr<E>&);
+      template <class E> Matrix& operator+= (const MatrixExpr<E>&);
+      template <class E> Matrix& operator-= (const MatrixExpr<E>&);
       Matrix& operator*= (double);             // multiply by scalar
-      Matrix& operator+= (const Matrix&);      // add a matrix
-      Matrix& operator-= (const Matrix&);      // subtract a matrix
-      Matrix  operator* (double) const;        // multiply by scalar
-      double dot (const Matrix&);
+      double dot (const Matrix&) const;
       ~Matrix ();
-      double& operator() (const unsigned int i, const unsigned int j) const;
-      double& operator() (const unsigned int i, const unsigned int j);
+      double& operator() (const unsigned int i, const unsigned int j) const
+      {
+         return data[i + nrow*j];
+      }
+      double& operator() (const unsigned int i, const unsigned int j)
+      {
+         return data[i + nrow*j];
+      }
+      double operator[] (const unsigned int k) const { return data[k]; }
+      unsigned int rows () const { return nrow; }
+      unsigned int cols () const { return ncol; }
       void allocate (const unsigned int, const unsigned int);
       unsigned int index (const unsigned int, const unsigned int);
 
@@ -27,4 +56,159 @@ class Matrix
       double* data;
 };
 
+// element by element operations
+struct MatrixAdd
+{
+   static double apply (const double a, const double b) { return a + b; }
+};
+struct MatrixSub
+{
+   static double apply (const double a, const double b) { return a - b; }
+};
+struct MatrixMul
+{
+   static double apply (const double a, const double b) { return a * b; }
+};
+
+// a op b
+template <class L, class R, class Op>
+class MatrixBinary : public MatrixExpr< MatrixBinary<L,R,Op> >
+{
+   public:
+      MatrixBinary (const L& a, const R& b) : a (a), b (b)
+      {
+         assert (a.rows() == b.rows());
+         assert (a.cols() == b.cols());
+      }
+      unsigned int rows () const { return a.rows(); }
+      unsigned int cols () const { return a.cols(); }
+      double operator[] (const unsigned int k) const
+      {
+         return Op::apply (a[k], b[k]);
+      }
+
+   private:
+      const L& a;
+      const R& b;
+};
+
+// scalar * a
+template <class E>
+class MatrixScaled : public MatrixExpr< MatrixScaled<E> >
+{
+   public:
+      MatrixScaled (const E& a, const double scalar) : a (a), scalar (scalar) {}
+      unsigned int rows () const { return a.rows(); }
+      unsigned int cols () const { return a.cols(); }
+      double operator[] (const unsigned int k) const { return scalar * a[k]; }
+
+   private:
+      const E& a;
+      const double scalar;
+};
+
+template <class L, class R>
+inline MatrixBinary<L,R,MatrixAdd>
+operator+ (const MatrixExpr<L>& a, const MatrixExpr<R>& b)
+{
+   return MatrixBinary<L,R,MatrixAdd> (a.self(), b.self());
+}
+
+template <class L, class R>
+inline MatrixBinary<L,R,MatrixSub>
+operator- (const MatrixExpr<L>& a, const MatrixExpr<R>& b)
+{
+   return MatrixBinary<L,R,MatrixSub> (a.self(), b.self());
+}
+
+template <class L, class R>
+inline MatrixBinary<L,R,MatrixMul>
+operator* (const MatrixExpr<L>& a, const MatrixExpr<R>& b)
+{
+   return MatrixBinary<L,R,MatrixMul> (a.self(), b.self());
+}
+
+template <class E>
+inline MatrixScaled<E> operator* (const MatrixExpr<E>& a, const double scalar)
+{
+   return MatrixScaled<E> (a.self(), scalar);
+}
+
+template <class E>
+inline MatrixScaled<E> operator* (const double scalar, const MatrixExpr<E>& a)
+{
+   return MatrixScaled<E> (a.self(), scalar);
+}
+
+// new matrix from an expression
+template <class E>
+Matrix::Matrix (const MatrixExpr<E>& expr)
+   :
+   nrow (expr.rows()),
+   ncol (expr.cols())
+{
+   assert (nrow > 0);
+   assert (ncol > 0);
+   data = new double [nrow*ncol];
+
+   const E& e = expr.self();
+   const unsigned int n = nrow * ncol;
+   for(unsigned int i=0; i<n; ++i)
+      data[i] = e[i];
+}
+
+// this = expression; if the sizes differ, this takes the size of expr. this
+// can only appear in expr when the sizes are equal, so freeing data is safe.
+template <class E>
+Matrix& Matrix::operator= (const MatrixExpr<E>& expr)
+{
+   if(nrow != expr.rows() || ncol != expr.cols())
+   {
+      if(nrow*ncol > 0)
+         delete [] data;
+      nrow = expr.rows();
+      ncol = expr.cols();
+      data = 0;
+      if(nrow*ncol > 0)
+         data = new double [nrow*ncol];
+   }
+
+   const E& e = expr.self();
+   const unsigned int n = nrow * ncol;
+   for(unsigned int i=0; i<n; ++i)
+      data[i] = e[i];
+
+   return *this;
+}
+
+// this = this + expression
+template <class E>
+Matrix& Matrix::operator+= (const MatrixExpr<E>& expr)
+{
+   assert (nrow == expr.rows());
+   assert (ncol == expr.cols());
+
+   const E& e = expr.self();
+   const unsigned int n = nrow * ncol;
+   for(unsigned int i=0; i<n; ++i)
+      data[i] += e[i];
+
+   return *this;
+}
+
+// this = this - expression
+template <class E>
+Matrix& Matrix::operator-= (const MatrixExpr<E>& expr)
+{
+   assert (nrow == expr.rows());
+   assert (ncol == expr.cols());
+
+   const E& e = expr.self();
+   const unsigned int n = nrow * ncol;
+   for(unsigned int i=0; i<n; ++i)
+      data[i] -= e[i];
+
+   return *this;
+}
+
 #endif
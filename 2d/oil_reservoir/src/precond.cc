@@ -0,0 +1,281 @@
+#include <iostream>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include "precond.h"
+
+using namespace std;
+
+// coarsest multigrid level has at most this many cells in each direction
+#define MG_COARSE 2
+// symmetric Gauss-Seidel sweeps on the coarsest level
+#define MG_COARSE_SWEEPS 20
+// The piecewise constant prolongation makes the coarse grid correction too
+// small. Scaling it up on the finest level cuts the number of CG iterations.
+// The cycles on the coarse grids are symmetric and not scaled, so that B A is
+// in (0,1] for their approximate inverse B; then any factor below 2 keeps the
+// preconditioner symmetric positive definite.
+#define MG_OVERCORRECT 1.8
+
+//------------------------------------------------------------------------------
+// preconditioner from its name in the input file
+//------------------------------------------------------------------------------
+PreconditionerType preconditioner_type (const string& name)
+{
+   for(unsigned int t=precond_none; t<=precond_mg; ++t)
+      if(name == preconditioner_names[t])
+         return PreconditionerType(t);
+
+   cout << "Unknown preconditioner " << name
+        << ", possible options: none, ic, mg" << endl;
+   abort ();
+}
+
+//------------------------------------------------------------------------------
+// prepare the preconditioner for the operator A
+//------------------------------------------------------------------------------
+void Preconditioner::setup (const PreconditionerType type_in, const Stencil& A)
+{
+   type = type_in;
+   if(type == precond_ic)
+      setup_ic (A);
+   else if(type == precond_mg)
+      setup_mg (A);
+}
+
+//------------------------------------------------------------------------------
+// z = M^{-1} r
+//------------------------------------------------------------------------------
+void Preconditioner::apply (const Matrix& r_in, Matrix& z)
+{
+   if(type == precond_none)
+      z = r_in;
+   else if(type == precond_ic)
+      apply_ic (r_in, z);
+   else
+   {
+      const Stencil& A = level[0];
+      for(unsigned int j=1; j<=A.ny; ++j)
+         for(unsigned int i=1; i<=A.nx; ++i)
+            b[0][A.index(i,j)] = r_in(i,j);
+      cycle (0);
+      for(unsigned int j=1; j<=A.ny; ++j)
+         for(unsigned int i=1; i<=A.nx; ++i)
+            z(i,j) = x[0][A.index(i,j)];
+   }
+}
+
+//------------------------------------------------------------------------------
+// incomplete Cholesky: M = (D - L) D^{-1} (D - L^T) where L is the strictly
+// lower part of A, and the pivots D are chosen so that diag(M) = diag(A)
+//------------------------------------------------------------------------------
+void Preconditioner::setup_ic (const Stencil& A)
+{
+   level.assign (1, A);
+   dinv.assign ((A.nx+2)*(A.ny+2), 0.0);
+   w.assign ((A.nx+2)*(A.ny+2), 0.0);
+
+   const unsigned int s = A.nx + 2;
+   for(unsigned int j=1; j<=A.ny; ++j)
+      for(unsigned int i=1; i<=A.nx; ++i)
+      {
+         const unsigned int c = A.index(i,j);
+         const double d = A.ap[c] - A.ae[c-1] * A.ae[c-1] * dinv[c-1]
+                                  - A.an[c-s] * A.an[c-s] * dinv[c-s];
+         assert (d > 0.0);
+         dinv[c] = 1.0 / d;
+      }
+}
+
+void Preconditioner::apply_ic (const Matrix& r_in, Matrix& z)
+{
+   const Stencil& A = level[0];
+   const unsigned int s = A.nx + 2;
+
+   // (D - L) w = r
+   for(unsigned int j=1; j<=A.ny; ++j)
+      for(unsigned int i=1; i<=A.nx; ++i)
+      {
+         const unsigned int c = A.index(i,j);
+         w[c] = (r_in(i,j) + A.ae[c-1] * w[c-1] + A.an[c-s] * w[c-s]) * dinv[c];
+      }
+
+   // (D - L^T) z = D w
+   for(unsigned int j=A.ny; j>=1; --j)
+      for(unsigned int i=A.nx; i>=1; --i)
+      {
+         const unsigned int c = A.index(i,j);
+         w[c] += (A.ae[c] * w[c+1] + A.an[c] * w[c+s]) * dinv[c];
+         z(i,j) = w[c];
+      }
+}
+
+//------------------------------------------------------------------------------
+// multigrid hierarchy: level[0] is A, each next level merges 2 x 2 cells
+//------------------------------------------------------------------------------
+void Preconditioner::setup_mg (const Stencil& A)
+{
+   level.resize (1);
+   level[0] = A;
+   while(level.back().nx > MG_COARSE && level.back().ny > MG_COARSE)
+   {
+      level.push_back (Stencil());
+      coarsen (level[level.size()-2], level.back());
+   }
+
+   x.resize (level.size());
+   b.resize (level.size());
+   t.resize (level.size());
+   for(unsigned int l=0; l<level.size(); ++l)
+   {
+      const unsigned int n = (level[l].nx+2) * (level[l].ny+2);
+      x[l].assign (n, 0.0);
+      b[l].assign (n, 0.0);
+      t[l].assign (n, 0.0);
+   }
+}
+
+//------------------------------------------------------------------------------
+// Galerkin operator P^T A P of the coarse grid, where P copies the value of a
+// coarse cell to its fine cells. Fine cell i belongs to coarse cell (i+1)/2.
+// Couplings between fine cells of different coarse cells add up to the
+// coarse coupling; couplings inside a coarse cell drop out of its diagonal.
+//------------------------------------------------------------------------------
+void Preconditioner::coarsen (const Stencil& fine, Stencil& coarse) const
+{
+   coarse.allocate ((fine.nx+1)/2, (fine.ny+1)/2);
+
+   for(unsigned int j=1; j<=fine.ny; ++j)
+      for(unsigned int i=1; i<=fine.nx; ++i)
+      {
+         const unsigned int f = fine.index(i,j);
+         const unsigned int c = coarse.index((i+1)/2, (j+1)/2);
+
+         coarse.ap[c] += fine.ap[f];
+
+         if(i < fine.nx)
+         {
+            if(i % 2) // east neighbour in the same coarse cell
+               coarse.ap[c] -= 2.0 * fine.ae[f];
+            else
+               coarse.ae[c] += fine.ae[f];
+         }
+
+         if(j < fine.ny)
+         {
+            if(j % 2) // north neighbour in the same coarse cell
+               coarse.ap[c] -= 2.0 * fine.an[f];
+            else
+               coarse.an[c] += fine.an[f];
+         }
+      }
+}
+
+//------------------------------------------------------------------------------
+// one Gauss-Seidel sweep for A x = b on level l, in the forward or the
+// backward order of the cells
+//------------------------------------------------------------------------------
+void Preconditioner::smooth (const unsigned int l, const bool forward)
+{
+   const Stencil& A = level[l];
+   const unsigned int s = A.nx + 2;
+   vector<double>& xl = x[l];
+   const vector<double>& bl = b[l];
+
+   if(forward)
+   {
+      for(unsigned int j=1; j<=A.ny; ++j)
+         for(unsigned int i=1; i<=A.nx; ++i)
+         {
+            const unsigned int c = A.index(i,j);
+            xl[c] = (bl[c] + A.ae[c-1] * xl[c-1] + A.ae[c] * xl[c+1]
+                           + A.an[c-s] * xl[c-s] + A.an[c] * xl[c+s]) / A.ap[c];
+         }
+   }
+   else
+   {
+      for(unsigned int j=A.ny; j>=1; --j)
+         for(unsigned int i=A.nx; i>=1; --i)
+         {
+            const unsigned int c = A.index(i,j);
+            xl[c] = (bl[c] + A.ae[c-1] * xl[c-1] + A.ae[c] * xl[c+1]
+                           + A.an[c-s] * xl[c-s] + A.an[c] * xl[c+s]) / A.ap[c];
+         }
+   }
+}
+
+//------------------------------------------------------------------------------
+// W-cycle for A x = b on level l starting from x = 0. Forward Gauss-Seidel
+// before and backward after the coarse grid correction keep it symmetric.
+// The W-cycle keeps the number of CG iterations nearly independent of the
+// grid size without scaling the coarse levels.
+//------------------------------------------------------------------------------
+void Preconditioner::cycle (const unsigned int l)
+{
+   const Stencil& A = level[l];
+   const unsigned int s = A.nx + 2;
+   vector<double>& xl = x[l];
+
+   fill (xl.begin(), xl.end(), 0.0);
+
+   if(l == level.size()-1)
+   {
+      for(unsigned int k=0; k<MG_COARSE_SWEEPS; ++k)
+      {
+         smooth (l, true);
+         smooth (l, false);
+      }
+      return;
+   }
+
+   smooth (l, true);
+
+   // restrict residual b - A x: sum over the fine cells of each coarse cell
+   const Stencil& C = level[l+1];
+   vector<double>& bc = b[l+1];
+   fill (bc.begin(), bc.end(), 0.0);
+   for(unsigned int j=1; j<=A.ny; ++j)
+      for(unsigned int i=1; i<=A.nx; ++i)
+      {
+         const unsigned int c = A.index(i,j);
+         bc[C.index((i+1)/2, (j+1)/2)] += b[l][c] - A.ap[c] * xl[c]
+                                        + A.ae[c-1] * xl[c-1] + A.ae[c] * xl[c+1]
+                                        + A.an[c-s] * xl[c-s] + A.an[c] * xl[c+s];
+      }
+
+   cycle (l+1);
+
+   // W-cycle: a second cycle on the next level for the residual the first
+   // one leaves. Unless the next level is the coarsest, which SGS solves.
+   vector<double>& xc = x[l+1];
+   if(l+2 < level.size())
+   {
+      const unsigned int sc = C.nx + 2;
+      vector<double>& tc = t[l+1];
+      for(unsigned int j=1; j<=C.ny; ++j)
+         for(unsigned int i=1; i<=C.nx; ++i)
+         {
+            const unsigned int c = C.index(i,j);
+            tc[c] = xc[c];
+         }
+      for(unsigned int j=1; j<=C.ny; ++j)
+         for(unsigned int i=1; i<=C.nx; ++i)
+         {
+            const unsigned int c = C.index(i,j);
+            bc[c] -= C.ap[c] * tc[c] - C.ae[c-1] * tc[c-1] - C.ae[c] * tc[c+1]
+                                     - C.an[c-sc] * tc[c-sc] - C.an[c] * tc[c+sc];
+         }
+      cycle (l+1);
+      for(unsigned int j=1; j<=C.ny; ++j)
+         for(unsigned int i=1; i<=C.nx; ++i)
+            xc[C.index(i,j)] += tc[C.index(i,j)];
+   }
+
+   // prolongate correction
+   const double scale = (l == 0) ? MG_OVERCORRECT : 1.0;
+   for(unsigned int j=1; j<=A.ny; ++j)
+      for(unsigned int i=1; i<=A.nx; ++i)
+         xl[A.index(i,j)] += scale * xc[C.index((i+1)/2, (j+1)/2)];
+
+   smooth (l, false);
+}
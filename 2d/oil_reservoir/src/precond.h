@@ -0,0 +1,48 @@
+#ifndef __PRECOND_H__
+#define __PRECOND_H__
+
+#include <vector>
+#include <string>
+#include "matrix.h"
+#include "stencil.h"
+
+enum PreconditionerType { precond_none, precond_ic, precond_mg };
+const char* const preconditioner_names[] = { "none", "ic", "mg" };
+
+// Symmetric positive definite preconditioners for CG with a Stencil:
+//    ic : incomplete Cholesky without fill-in
+//    mg : one multigrid W-cycle. Coarse grids merge 2 x 2 cells, the coarse
+//         operators are the Galerkin ones, which are again five point, and
+//         symmetric Gauss-Seidel is the smoother.
+class Preconditioner
+{
+   public:
+      Preconditioner () { type = precond_none; };
+      ~Preconditioner () {};
+      void setup (const PreconditionerType, const Stencil&);
+      void apply (const Matrix& r, Matrix& z);
+
+   private:
+      PreconditionerType type;
+
+      // level[0] is the operator, the others are the coarse grids of mg
+      std::vector<Stencil> level;
+
+      // ic
+      std::vector<double> dinv; // inverse pivots
+      std::vector<double> w;
+
+      // mg: solution and right hand side on each level
+      std::vector< std::vector<double> > x, b, t;
+
+      void setup_ic (const Stencil&);
+      void apply_ic (const Matrix&, Matrix&);
+      void setup_mg (const Stencil&);
+      void coarsen (const Stencil&, Stencil&) const;
+      void smooth (const unsigned int, const bool forward);
+      void cycle (const unsigned int);
+};
+
+PreconditionerType preconditioner_type (const std::string&);
+
+#endif
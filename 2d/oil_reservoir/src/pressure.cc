@@ -1,5 +1,7 @@
 #include <iostream>
 #include <valarray>
+#include <ctime>
+#include <algorithm>
 #include "matrix.h"
 #include "grid.h"
 #include "pressure.h"
@@ -10,60 +12,93 @@ using namespace std;
 //------------------------------------------------------------------------------
 // constructor given grid
 //------------------------------------------------------------------------------
-PressureProblem::PressureProblem (Grid* grid_in)
+PressureProblem::PressureProblem (Grid* grid_in,
+                                  const PreconditionerType precond_type,
+                                  const double tolerance,
+                                  const unsigned int max_iter)
+   :
+   precond_type (precond_type),
+   tolerance (tolerance),
+   max_iter (max_iter)
 {
    // set pointer grid to grid_in
    grid = grid_in;
 }
 
 //------------------------------------------------------------------------------
-// compute rhs (b) of pressure equation A*p=b
+// Assemble A and b of the pressure equation A*p = b. The cells are
+// i=1,...,nx-1 and j=1,...,ny-1; inlet and outlet faces only add to the
+// diagonal of A and to b. Mobilities are found once per cell and the face
+// coefficients once per face, so that each CG iteration is only a stencil
+// product.
 //------------------------------------------------------------------------------
-Matrix PressureProblem::compute_rhs (const Matrix& saturation,
-                                     const Matrix& concentration,
-                                     const Matrix& permeability,
-                                     const Matrix& pressure)
+void PressureProblem::assemble (const Matrix& saturation,
+                                const Matrix& concentration,
+                                const Matrix& permeability)
 {
    unsigned int i, j;
-   double mobility_water_left, mobility_oil_left;
-   double mobility_water_right, mobility_oil_right;
-   double mobility_left, mobility_right;
-   double perm_left, perm_right;
-   double theta_left, theta_right, theta;
-   double m_perm_left, m_perm_right, m_perm;
-   double flux;
-   Matrix result(grid->nx+1, grid->ny+1);
+   double mobility_water_cell, mobility_oil_cell;
+   double m_perm, theta, coef, flux;
 
-   result = 0.0;
+   if(stencil.nx == 0)
+   {
+      stencil.allocate (grid->nx-1, grid->ny-1);
+      rhs.allocate    (grid->nx+1, grid->ny+1);
+      m_perm_cell.allocate (grid->nx+1, grid->ny+1);
+      theta_cell.allocate  (grid->nx+1, grid->ny+1);
+   }
+   fill (stencil.ap.begin(), stencil.ap.end(), 0.0);
+   rhs = 0.0;
+
+   // total mobility times permeability and gravity term in real and ghost
+   // cells; corner ghost cells are not used
+   for(j=0; j<=grid->ny; ++j)
+   {
+      const unsigned int ifirst = (j == 0 || j == grid->ny) ? 1 : 0;
+      const unsigned int ilast  = (j == 0 || j == grid->ny) ? grid->nx-1
+                                                            : grid->nx;
+      for(i=ifirst; i<=ilast; ++i)
+      {
+         mobility_water_cell = mobility_water (saturation(i,j), concentration(i,j));
+         mobility_oil_cell   = mobility_oil   (saturation(i,j), concentration(i,j));
+         m_perm_cell(i,j) = (mobility_water_cell + mobility_oil_cell) *
+                            permeability(i,j);
+         theta_cell(i,j)  = (mobility_water_cell * density_water +
+                             mobility_oil_cell   * density_oil) * gravity *
+                            permeability(i,j);
+      }
+   }
+
+   // interior vertical faces
+   for(i=2; i<=grid->nx-1; ++i)
+      for(j=1; j<=grid->ny-1; ++j)
+      {
+         m_perm = harmonic_average (m_perm_cell(i-1,j), m_perm_cell(i,j));
+
+         coef = m_perm / grid->dx * grid->dy;
+         stencil.ae[stencil.index(i-1,j)] = coef;
+         stencil.ap[stencil.index(i-1,j)] += coef;
+         stencil.ap[stencil.index(i,j)]   += coef;
+      }
 
    // interior horizontal faces
    // contribution from gravity term
    for(j=2; j<=grid->ny-1; ++j)
       for(i=1; i<=grid->nx-1; ++i)
       {
-         mobility_water_left = mobility_water (saturation(i,j-1), concentration(i,j-1));
-         mobility_oil_left = mobility_oil (saturation(i,j-1), concentration(i,j-1));
-         mobility_left = mobility_water_left + mobility_oil_left;
-         perm_left = permeability (i,j-1);
-         m_perm_left = mobility_left * perm_left;
-         theta_left = (mobility_water_left * density_water +
-                       mobility_oil_left   * density_oil) * gravity * perm_left;
-
-         mobility_water_right = mobility_water (saturation(i,j), concentration(i,j));
-         mobility_oil_right = mobility_oil (saturation(i,j), concentration(i,j));
-         mobility_right = mobility_water_right + mobility_oil_right;
-         perm_right = permeability (i,j);
-         m_perm_right = mobility_right * perm_right;
-         theta_right = (mobility_water_right * density_water +
-                        mobility_oil_right   * density_oil) * gravity * perm_right;
-
-         m_perm = harmonic_average (m_perm_left, m_perm_right);
-
-         theta  = 0.5 * m_perm * ( theta_left/m_perm_left + theta_right/m_perm_right );
+         m_perm = harmonic_average (m_perm_cell(i,j-1), m_perm_cell(i,j));
+
+         coef = m_perm / grid->dy * grid->dx;
+         stencil.an[stencil.index(i,j-1)] = coef;
+         stencil.ap[stencil.index(i,j-1)] += coef;
+         stencil.ap[stencil.index(i,j)]   += coef;
+
+         theta  = 0.5 * m_perm * ( theta_cell(i,j-1)/m_perm_cell(i,j-1) +
+                                   theta_cell(i,j)  /m_perm_cell(i,j) );
          flux   = theta * grid->dx;
 
-         result(i,j)   -= flux;
-         result(i,j-1) += flux;
+         rhs(i,j)   -= flux;
+         rhs(i,j-1) += flux;
       }
 
    // inlet/outlet boundaries
@@ -76,24 +111,20 @@ Matrix PressureProblem::compute_rhs (const Matrix& saturation,
          i = grid->ibeg[n];
          for(j=grid->jbeg[n]; j<grid->jend[n]; ++j)
          {
-            mobility_left = mobility_total (saturation(i-1,j), concentration(i-1,j));
-            perm_left = permeability (i-1,j);
-            mobility_right = mobility_total (saturation(i,j), concentration(i,j));
-            perm_right = permeability (i,j);
-            m_perm = harmonic_average (mobility_left  * perm_left, 
-                                       mobility_right * perm_right);
+            m_perm = harmonic_average (m_perm_cell(i-1,j), m_perm_cell(i,j));
+            coef   = m_perm / grid->dx * grid->dy;
 
             if (i == 1 && bc == INLET) // inlet-vertical side
             {
                // dpdn = (pressure(i,j) - pinlet)/(dx)
-               flux         = m_perm * (-pinlet)/(grid->dx) * grid->dy;
-               result(i,j) -= flux;
+               stencil.ap[stencil.index(i,j)] += coef;
+               rhs(i,j) += coef * pinlet;
             }
             else if (i == grid->nx && bc == OUTLET) // outlet-vertical side
             {
                // dpdn = (poutlet - pressure(i-1,j))/(dx)
-               flux           = m_perm * (poutlet)/(grid->dx) * grid->dy;
-               result(i-1,j) += flux;
+               stencil.ap[stencil.index(i-1,j)] += coef;
+               rhs(i-1,j) += coef * poutlet;
             }
             else
             {
@@ -108,39 +139,22 @@ Matrix PressureProblem::compute_rhs (const Matrix& saturation,
          j = grid->jbeg[n];
          for(i=grid->ibeg[n]; i<grid->iend[n]; ++i)
          {
-            mobility_water_left = mobility_water (saturation(i,j-1), concentration(i,j-1));
-            mobility_oil_left = mobility_oil (saturation(i,j-1), concentration(i,j-1));
-            mobility_left = mobility_water_left + mobility_oil_left;
-            perm_left = permeability (i,j-1);
-            m_perm_left = mobility_left * perm_left;
-            theta_left = (mobility_water_left * density_water +
-                          mobility_oil_left   * density_oil) * gravity * perm_left;
-
-            mobility_water_right = mobility_water (saturation(i,j), concentration(i,j));
-            mobility_oil_right = mobility_oil (saturation(i,j), concentration(i,j));
-            mobility_right = mobility_water_right + mobility_oil_right;
-            perm_right = permeability (i,j);
-            m_perm_right = mobility_right * perm_right;
-            theta_right = (mobility_water_right * density_water +
-                           mobility_oil_right   * density_oil) * gravity * perm_right;
-
-            m_perm = harmonic_average (m_perm_left, m_perm_right);
-
-            theta  = 0.5 * m_perm * ( theta_left/m_perm_left + theta_right/m_perm_right );
+            m_perm = harmonic_average (m_perm_cell(i,j-1), m_perm_cell(i,j));
+            coef   = m_perm / grid->dy * grid->dx;
+            theta  = 0.5 * m_perm * ( theta_cell(i,j-1)/m_perm_cell(i,j-1) +
+                                      theta_cell(i,j)  /m_perm_cell(i,j) );
 
             if(j == 1 && bc == INLET) // inlet-horizontal side
             {
                // dpdn = (pressure(i,j) - pinlet)/(dy)
-               flux         = m_perm * (-pinlet)/(grid->dy) * grid->dx
-                            + theta * grid->dx;
-               result(i,j) -= flux;
+               stencil.ap[stencil.index(i,j)] += coef;
+               rhs(i,j) += coef * pinlet - theta * grid->dx;
             }
             else if(j == grid->ny && bc == OUTLET) // outlet-horizontal side
             {
                // dpdn = (poutlet - pressure(i,j-1))/(dy)
-               flux           = m_perm * (poutlet)/(grid->dy) * grid->dx
-                              + theta * grid->dx;
-               result(i,j-1) += flux;
+               stencil.ap[stencil.index(i,j-1)] += coef;
+               rhs(i,j-1) += coef * poutlet + theta * grid->dx;
             }
             else
             {
@@ -150,198 +164,128 @@ Matrix PressureProblem::compute_rhs (const Matrix& saturation,
          }
       }
    }
-
-   return result;
-
 }
 
 //------------------------------------------------------------------------------
 // compute matrix vector product A*p in pressure equation A*p = b
 //------------------------------------------------------------------------------
-Matrix PressureProblem::A_times_pressure (const Matrix& saturation,
-                                          const Matrix& concentration,
-                                          const Matrix& permeability,
-                                          const Matrix& pressure)
+void PressureProblem::A_times_pressure (const Matrix& pressure,
+                                              Matrix& result) const
 {
-   unsigned int i, j;
-   double mobility_left, mobility_right;
-   double perm_left, perm_right;
-   double m_perm, dpdn, flux;
-   Matrix result(grid->nx+1, grid->ny+1);
-
-   result = 0.0;
-
-   // interior vertical faces
-   for(i=2; i<=grid->nx-1; ++i)
-      for(j=1; j<=grid->ny-1; ++j)
-      {
-         mobility_left = mobility_total (saturation(i-1,j), concentration(i-1,j));
-         perm_left = permeability (i-1,j);
-         mobility_right = mobility_total (saturation(i,j), concentration(i,j));
-         perm_right = permeability (i,j);
-         m_perm = harmonic_average (mobility_left  * perm_left, 
-                                    mobility_right * perm_right);
-
-         dpdn = (pressure(i,j) - pressure(i-1,j))/grid->dx;
-
-         flux           = - m_perm * dpdn * grid->dy;
-         result(i-1,j) += flux;
-         result(i,j)   -= flux;
-      }
-
-   // interior horizontal faces
-   for(j=2; j<=grid->ny-1; ++j)
-      for(i=1; i<=grid->nx-1; ++i)
-      {
-         mobility_left = mobility_total (saturation(i,j-1), concentration(i,j-1));
-         perm_left = permeability (i,j-1);
-         mobility_right = mobility_total (saturation(i,j), concentration(i,j));
-         perm_right = permeability (i,j);
-         m_perm = harmonic_average (mobility_left  * perm_left, 
-                                    mobility_right * perm_right);
-
-         dpdn = (pressure(i,j) - pressure(i,j-1))/grid->dy;
-
-         flux           = - m_perm * dpdn * grid->dx;
-         result(i,j)   -= flux;
-         result(i,j-1) += flux;
-      }
-
-   // inlet/outlet boundaries: vertical
-   for(unsigned int n=0; n<grid->n_boundary; ++n)
-   {
-      if (grid->ibeg[n] == grid->iend[n])
-      {
-         i = grid->ibeg[n];
-         for(j=grid->jbeg[n]; j<grid->jend[n]; ++j)
-         {
-            mobility_left = mobility_total (saturation(i-1,j), concentration(i-1,j));
-            perm_left = permeability (i-1,j);
-            mobility_right = mobility_total (saturation(i,j), concentration(i,j));
-            perm_right = permeability (i,j);
-            m_perm = harmonic_average (mobility_left  * perm_left, 
-                                       mobility_right * perm_right);
-
-            if (grid->ibeg[n] == 1) // inlet-vertical side
-            {
-               // dpdn = (pressure(i,j) - pinlet)/(dx)
-               flux         = - m_perm * pressure(i,j)/(grid->dx) * grid->dy;
-               result(i,j) -= flux;
-            }
-            else // outlet-vertical side
-            {
-               // dpdn = (poutlet - pressure(i-1,j))/(dx)
-               flux           = - m_perm * (-pressure(i-1,j))/(grid->dx) * grid->dy;
-               result(i-1,j) += flux;
-            }
-         }
-      }
-
-      // inlet/outlet boundaries: horizontal
-      if (grid->jbeg[n] == grid->jend[n])
-      {
-         j = grid->jbeg[n];
-         for(i=grid->ibeg[n]; i<grid->iend[n]; ++i)
-         {
-            mobility_left = mobility_total (saturation(i,j-1), concentration(i,j-1));
-            perm_left = permeability (i,j-1);
-            mobility_right = mobility_total (saturation(i,j), concentration(i,j));
-            perm_right = permeability (i,j);
-            m_perm = harmonic_average (mobility_left  * perm_left, 
-                                       mobility_right * perm_right);
-
-            if(grid->jbeg[n] == 1) // inlet-horizontal side
-            {
-               // dpdn = (pressure(i,j) - pinlet)/(dy)
-               flux         = - m_perm * (pressure(i,j))/(grid->dy) * grid->dx;
-               result(i,j) -= flux;
-            }
-            else // outlet-horizontal side
-            {
-               // dpdn = (poutlet - pressure(i,j-1))/(dy)
-               flux           = - m_perm * (-pressure(i,j-1))/(grid->dy) * grid->dx;
-               result(i,j-1) += flux;
-            }
-         }
-      }
-   }
-
-   return result;
-
+   stencil.multiply (pressure, result);
 }
 
 //------------------------------------------------------------------------------
 // Compute residual for pressure problem, r = b - A*p
 //------------------------------------------------------------------------------
-Matrix PressureProblem::residual (const Matrix& saturation, 
-                                  const Matrix& concentration,
-                                  const Matrix& permeability,
-                                  const Matrix& pressure)
+void PressureProblem::residual (const Matrix& pressure, Matrix& r) const
 {
-   Matrix r(grid->nx+1, grid->ny+1);
-
-   r = compute_rhs (saturation, concentration, permeability, pressure)
-     - A_times_pressure(saturation, concentration, permeability, pressure);
-
-   return r;
+   A_times_pressure (pressure, r);
+   for(unsigned int j=1; j<=grid->ny-1; ++j)
+      for(unsigned int i=1; i<=grid->nx-1; ++i)
+         r(i,j) = rhs(i,j) - r(i,j);
 }
 
 //------------------------------------------------------------------------------
-// Solve pressure equation by CG method
+// Solve pressure equation by preconditioned CG method. Returns false if it did
+// not converge in max_iter iterations; pressure is then the last iterate.
 //------------------------------------------------------------------------------
-void PressureProblem::run (const Matrix& saturation, 
+bool PressureProblem::run (const Matrix& saturation, 
                            const Matrix& concentration,
                            const Matrix& permeability,
                                  Matrix& pressure)
 {
-   const unsigned int max_iter = 5000;
-   const double tolerance = 1.0e-6;
    unsigned int iter = 0;
-   double beta, omega;
-   vector<double> r2(max_iter);
+   double beta, omega, r2, r2_0, rz, rz_old, dv;
    Matrix d (grid->nx + 1, grid->ny + 1);
    Matrix r (grid->nx + 1, grid->ny + 1);
    Matrix v (grid->nx + 1, grid->ny + 1);
+   Matrix z (grid->nx + 1, grid->ny + 1);
+
+   // only the cells are computed, keep the halo zero
+   r = 0.0;
+   v = 0.0;
+   z = 0.0;
+
+   // without preconditioner, z is r
+   const bool use_precond = (precond_type != precond_none);
+   const Matrix& zr = use_precond ? z : r;
+
+   const clock_t t0 = clock ();
+   assemble (saturation, concentration, permeability);
+   if (use_precond)
+      precond.setup (precond_type, stencil);
+   const clock_t t1 = clock ();
 
    // initial residual
-   r = residual (saturation, concentration, permeability, pressure);
+   residual (pressure, r);
+   if (use_precond) precond.apply (r, z);
 
    // initial direction
-   d = r;
+   d = zr;
 
-   r2[0] = r.dot(r);
+   r2 = r2_0 = r.dot(r);
+   rz = use_precond ? r.dot(z) : r2;
+   rz_old = rz;
 
    // CG iterations
-   while ( sqrt(r2[iter]/r2[0]) > tolerance && iter < max_iter )
+   while ( sqrt(r2/r2_0) > tolerance && iter < max_iter )
    {
+      // A and the preconditioner are symmetric positive definite, so r.z and
+      // d.Ad can only be non-positive or NaN if something is broken
+      if (!(rz > 0.0))
+      {
+         cout << "PressureProblem: CG breakdown, r.z = " << rz
+              << " at iter= " << iter << endl;
+         abort ();
+      }
+
       if (iter >= 1) // update descent direction
-      {              // d = r + beta * d
-         beta = r2[iter] / r2[iter-1];
-         d   *= beta;
-         d   += r;
+      {              // d = z + beta * d
+         beta = rz / rz_old;
+         d    = zr + d * beta;
       }
 
-      v = A_times_pressure (saturation, concentration, permeability, d);
-      omega = r2[iter] / d.dot(v);
+      A_times_pressure (d, v);
+      dv = d.dot(v);
+      if (!(dv > 0.0))
+      {
+         cout << "PressureProblem: CG breakdown, d.Ad = " << dv
+              << " at iter= " << iter << endl;
+         abort ();
+      }
+      omega = rz / dv;
 
       // update pressure: p = p + omega * d
       pressure += d * omega;
 
       // update residual: r = r - omega * v
-      v *= omega;
-      r -= v;
+      r -= v * omega;
 
       ++iter;
 
-      r2[iter] = r.dot(r);
+      r2 = r.dot(r);
+      rz_old = rz;
+      if (use_precond)
+      {
+         precond.apply (r, z);
+         rz = r.dot(z);
+      }
+      else
+         rz = r2;
    }
+   const clock_t t2 = clock ();
 
    cout << "PressureProblem: iter= " << iter 
-        << " residue= " << sqrt(r2[iter]/r2[0]) << endl;
+        << " residue= " << sqrt(r2/r2_0)
+        << " setup= " << double(t1 - t0) / CLOCKS_PER_SEC << "s"
+        << " solve= " << double(t2 - t1) / CLOCKS_PER_SEC << "s" << endl;
 
-   if (sqrt(r2[iter]) > tolerance && iter==max_iter)
+   if (sqrt(r2/r2_0) > tolerance)
    {
       cout << "PressureProblem did not converge !!!" << endl;
-      abort ();
+      return false;
    }
+
+   return true;
 }
@@ -5,6 +5,8 @@
 #include <valarray>
 #include "matrix.h"
 #include "grid.h"
+#include "stencil.h"
+#include "precond.h"
 
 extern double pinlet;
 extern double poutlet;
@@ -13,28 +15,31 @@ class PressureProblem
 {
    public:
       PressureProblem () {};
-      PressureProblem (Grid*);
+      PressureProblem (Grid*,
+                       const PreconditionerType precond_type = precond_none,
+                       const double tolerance = 1.0e-6,
+                       const unsigned int max_iter = 5000);
       ~PressureProblem () {};
-      void run (const Matrix& saturation, 
+      bool run (const Matrix& saturation, 
                 const Matrix& concentration,
                 const Matrix& permeability,
                       Matrix& pressure);
 
    private:
       Grid*  grid;
+      PreconditionerType precond_type;
+      double tolerance;
+      unsigned int max_iter;
+      Stencil stencil; // A in A*p = b
+      Matrix  rhs;     // b in A*p = b
+      Matrix  m_perm_cell, theta_cell;
+      Preconditioner precond;
 
-      Matrix compute_rhs (const Matrix& saturation,
-                          const Matrix& concentration,
-                          const Matrix& permeability,
-                          const Matrix& pressure);
-      Matrix A_times_pressure (const Matrix& saturation,
-                               const Matrix& concentration,
-                               const Matrix& permeability,
-                               const Matrix& pressure);
-      Matrix residual (const Matrix& saturation,
-                       const Matrix& concentration,
-                       const Matrix& permeability,
-                       const Matrix& pressure);
+      void assemble (const Matrix& saturation,
+                     const Matrix& concentration,
+                     const Matrix& permeability);
+      void A_times_pressure (const Matrix& pressure, Matrix& result) const;
+      void residual (const Matrix& pressure, Matrix& r) const;
 };
 
 #endif
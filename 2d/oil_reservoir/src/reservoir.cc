@@ -3,14 +3,14 @@
 #include <sstream>
 #include <cstdlib>
 #include <cassert>
+#include <ctime>
 #include "material.h"
 #include "pressure.h"
 #include "reservoir.h"
 
 #define SIGN(a) (((a)<0) ? -1:1)
 
-extern int n_interior_min;
-const double beta = 2.0; // factor in minmod limiter
+const double limiter_beta = 2.0; // factor in minmod limiter
 
 using namespace std;
 
@@ -28,7 +28,7 @@ double minmod (const double& ul, const double& u0, const double& ur)
 
    if (db*dc > 0.0 && dc*df > 0.0)
    {
-      result = min( min(fabs(beta*db), fabs(dc)), fabs(beta*df) );
+      result = min( min(fabs(limiter_beta*db), fabs(dc)), fabs(limiter_beta*df) );
       result *= SIGN(db);
    }
    else
@@ -41,7 +41,7 @@ double minmod (const double& ul, const double& u0, const double& ur)
 // Find left state at interface between (il,jl) and (ir,jr)
 // (ill,jll) is to the left of (il,jl)
 //------------------------------------------------------------------------------
-vector<double> ReservoirProblem::reconstruct
+State ReservoirProblem::reconstruct
        (
        const unsigned int& ill,
        const unsigned int& jll,
@@ -60,7 +60,7 @@ vector<double> ReservoirProblem::reconstruct
 //------------------------------------------------------------------------------
 // First order reconstruction
 //------------------------------------------------------------------------------
-vector<double> ReservoirProblem::reconstruct1
+State ReservoirProblem::reconstruct1
        (
        const unsigned int& ill,
        const unsigned int& jll,
@@ -70,11 +70,11 @@ vector<double> ReservoirProblem::reconstruct1
        const unsigned int& jr
        ) const
 {
-   vector<double> state(3);
+   State state;
 
-   state[0] = saturation    (il, jl);
-   state[1] = concentration (il, jl); 
-   state[2] = permeability  (il, jl); 
+   state.saturation    = saturation    (il, jl);
+   state.concentration = concentration (il, jl); 
+   state.permeability  = permeability  (il, jl); 
 
    return state;
 }
@@ -82,7 +82,7 @@ vector<double> ReservoirProblem::reconstruct1
 //------------------------------------------------------------------------------
 // Second order reconstruction
 //------------------------------------------------------------------------------
-vector<double> ReservoirProblem::reconstruct2
+State ReservoirProblem::reconstruct2
        (
        const unsigned int& ill,
        const unsigned int& jll,
@@ -92,14 +92,14 @@ vector<double> ReservoirProblem::reconstruct2
        const unsigned int& jr
        ) const
 {
-   vector<double> state(3);
+   State state;
    double ds, dp;
 
    // saturation
    ds = minmod (saturation(ill,jll), 
                 saturation(il,jl), 
                 saturation(ir,jr));
-   state[0] = saturation (il,jl) + 0.5 * ds;
+   state.saturation = saturation (il,jl) + 0.5 * ds;
 
    // concentration
    // We reconstruct b = s*c
@@ -107,17 +107,17 @@ vector<double> ReservoirProblem::reconstruct2
    double bl  = saturation(il ,jl ) * concentration(il ,jl );
    double br  = saturation(ir ,jr ) * concentration(ir ,jr );
    double db  = minmod (bll, bl, br);
-   state[1]   = (bl + 0.5 * db);
-   if (state[0] > SZERO)
-      state[1] /= state[0];
+   state.concentration = (bl + 0.5 * db);
+   if (state.saturation > SZERO)
+      state.concentration /= state.saturation;
    else
-      state[1] = 0.0;
+      state.concentration = 0.0;
 
    // permeability
    dp = minmod (permeability(ill,jll), 
                 permeability(il,jl), 
                 permeability(ir,jr));
-   state[2] = permeability (il, jl) + 0.5 * dp;
+   state.permeability = permeability (il, jl) + 0.5 * dp;
 
    return state;
 }
@@ -180,84 +180,113 @@ double ReservoirProblem::darcy_velocity
 }
 
 //------------------------------------------------------------------------------
-// Find location of minimum for the flux
-// This should be called only with g > 0
+// With gravity, the water flux at a face as a function of saturation s is
+// proportional to
+//    phi(s) = (z - (1-s)^2) r s^2 / (r s^2 + (1-s)^2)
+// with r = mu_oil/mu_water and z = velocity*mu_oil/((d_water-d_oil)*g*perm).
+// phi'(s) has the sign of Q(s) = z + r s^3 - (1-s)^3, which increases with s.
+// Hence phi has a minimum inside [0,1] only if Q(0) <= 0 <= Q(1), i.e.
+// -r <= z <= 1, and s lies to the right of the minimum if Q(s) >= 0.
+//
+// Find location of minimum for the flux: root of Q(s) by Cardano's formula
 //------------------------------------------------------------------------------
-double argmin_flux(const double& concentration,
-                   const double& permeability,
-                   const double& velocity)
+double argmin_flux(const double& r, const double& z)
 {
-   double r = viscosity_oil / viscosity_water (concentration);
-   double z = velocity * viscosity_oil / 
-      ((density_water - density_oil) * gravity * permeability);
-   double alpha = 27.0 * (-r + r * r - z - 2.0 * r * z - r * r * z);
-   double beta  = 2916.0 * r * r * r + alpha * alpha;
+   static const double fact = 3.0 * cbrt(2.0);
 
-   double gamma = pow( alpha + sqrt(beta), 1.0/3.0);
-   double fact  = 3.0 * pow(2.0, 1.0/3.0);
+   double alpha = 27.0 * (r * (r - 1.0) - z * (1.0 + r) * (1.0 + r));
+   double r3    = 2916.0 * r * r * r;
+   double beta  = r3 + alpha * alpha;
 
-   double sstar = (1.0 - fact * r / gamma + gamma / fact) / (1.0 + r);
+   // alpha + sqrt(beta) > 0, but for alpha < 0 the sum cancels, so use
+   // (alpha + sqrt(beta)) * (sqrt(beta) - alpha) = r3 instead
+   double root  = sqrt(beta);
+   double gamma = cbrt( (alpha >= 0.0) ? alpha + root : r3 / (root - alpha) );
 
-   double s_min;
+   return (1.0 - fact * r / gamma + gamma / fact) / (1.0 + r);
+}
 
-   if(sstar <= 1.0 && sstar >= 0.0)
+//------------------------------------------------------------------------------
+// Saturation at which the dflu flux is evaluated on one side of a face:
+// max(s, s_min) on the left side and min(s, s_min) on the right side, where
+// s_min is the location of the minimum of the flux. s_min is only computed
+// when it changes s, and then only if r or z differ from those in cache,
+// unless cache is 0. Within a time step the pressure is fixed, so r and z
+// repeat in the RK stages wherever s and c do not change. n_interior_min is
+// incremented if the minimum is inside [0,1]. This should be called only with
+// g > 0.
+//------------------------------------------------------------------------------
+double dflu_saturation(const double& saturation,
+                       const double& concentration,
+                       const double& permeability,
+                       const double& velocity,
+                       const bool    left,
+                       ArgminCache*  cache,
+                       unsigned int& n_interior_min)
+{
+   double r = viscosity_oil / viscosity_water (concentration);
+   double z = velocity * viscosity_oil / 
+      ((density_water - density_oil) * gravity * permeability);
+
+   if(z > 1.0 || z < -r) // minimum is at 0 or 1
    {
-      s_min = sstar;
-      ++n_interior_min;
+      double s_min = (velocity > 0.0) ? 0.0 : 1.0;
+      return left ? max(saturation, s_min) : min(saturation, s_min);
    }
-   else
-      s_min = (velocity > 0.0) ? 0.0 : 1.0;
 
-   return s_min;
-}
+   ++n_interior_min;
 
-//------------------------------------------------------------------------------
-// call appropriate numerical flux function
-//------------------------------------------------------------------------------
-vector<double> ReservoirProblem::num_flux
-       (
-       const double& velocity,
-       const vector<double>& state_left,
-       const vector<double>& state_right,
-       const double& g
-       )
-{
-   vector<double> flux(2);
+   double q = z + r * saturation * saturation * saturation
+                - (1.0 - saturation) * (1.0 - saturation) * (1.0 - saturation);
+   if((left && q >= 0.0) || (!left && q <= 0.0))
+      return saturation;
 
-   if(flux_type=="dflu")
-      flux = dflu_flux (velocity, state_left, state_right, g);
+   double s_min;
+   if(cache == 0)
+      s_min = argmin_flux(r, z);
+   else
+   {
+      if(cache->r != r || cache->z != z)
+      {
+         cache->r     = r;
+         cache->z     = z;
+         cache->s_min = argmin_flux(r, z);
+      }
+      s_min = cache->s_min;
+   }
 
-   return flux;
+   return left ? max(saturation, s_min) : min(saturation, s_min);
 }
 
 //------------------------------------------------------------------------------
 // dflu umerical flux function
 //------------------------------------------------------------------------------
-vector<double> dflu_flux
+Flux dflu_flux
        (
        const double& velocity,
-       const vector<double>& state_left,
-       const vector<double>& state_right,
-       const double& g
+       const State& state_left,
+       const State& state_right,
+       const double& g,
+       ArgminCache* cache,
+       unsigned int& n_interior_min
        )
 {
-   double s_left  = state_left[0];
-   double c_left  = state_left[1];
-   double s_right = state_right[0];
-   double c_right = state_right[1];
+   double s_left  = state_left.saturation;
+   double c_left  = state_left.concentration;
+   double s_right = state_right.saturation;
+   double c_right = state_right.concentration;
 
-   vector<double> flux(2);
+   Flux flux;
 
    if(g > 0.0) // Gravity is present
    {
-      double perm_left = state_left[2];
-      double s_min_left = argmin_flux(c_left, perm_left, velocity);
+      double perm_left  = state_left.permeability;
+      double perm_right = state_right.permeability;
 
-      double perm_right = state_right[2];
-      double s_min_right = argmin_flux(c_right, perm_right, velocity);
-
-      s_left  = max( s_left,  s_min_left);
-      s_right = min( s_right, s_min_right);
+      s_left  = dflu_saturation (s_left, c_left, perm_left, velocity,
+                                 true, cache, n_interior_min);
+      s_right = dflu_saturation (s_right, c_right, perm_right, velocity,
+                                 false, cache ? cache+1 : 0, n_interior_min);
 
       double m_water_left = mobility_water (s_left, c_left);
       double m_oil_left   = mobility_oil (s_left, c_left);
@@ -273,12 +302,12 @@ vector<double> dflu_flux
          - (density_water - density_oil) * gravity * m_oil_right * perm_right;
       double f_left  = v_left  * m_water_left / m_total_left;
       double f_right = v_right * m_water_right / m_total_right;
-      flux[0]        = max( f_left, f_right );
+      flux.water     = max( f_left, f_right );
 
-      if(flux[0] > 0.0)
-         flux[1] = c_left  * flux[0];
+      if(flux.water > 0.0)
+         flux.polymer = c_left  * flux.water;
       else
-         flux[1] = c_right * flux[0];
+         flux.polymer = c_right * flux.water;
    }
    else // Gravity is not present
    {
@@ -292,13 +321,13 @@ vector<double> dflu_flux
 
       if (velocity > 0)
       {
-         flux[0] = velocity * m_water_left / m_total_left;
-         flux[1] = c_left * flux[0];
+         flux.water = velocity * m_water_left / m_total_left;
+         flux.polymer = c_left * flux.water;
       }
       else
       {
-         flux[0] = velocity * m_water_right / m_total_right;
-         flux[1] = c_right * flux[0];
+         flux.water = velocity * m_water_right / m_total_right;
+         flux.polymer = c_right * flux.water;
       }
    }
 
@@ -318,7 +347,13 @@ void ReservoirProblem::read_input ()
 
    inp >> input >> flux_type;      
    assert (input=="flux");
-   assert (flux_type=="dflu");
+   if (flux_type == "dflu")
+      num_flux = dflu_flux;
+   else
+   {
+      cout << "Unknown flux " << flux_type << ", possible options: dflu" << endl;
+      abort ();
+   }
 
    inp >> input >> order;      
    assert(input == "order");
@@ -391,6 +426,44 @@ void ReservoirProblem::read_input ()
       }
    }
 
+   // optional settings of the pressure solver
+   pressure_precond  = precond_none;
+   pressure_tol      = 1.0e-6;
+   pressure_max_iter = 5000;
+   pressure_continue = false;
+   while (inp >> input)
+   {
+      if (input == "p_precond")
+      {
+         inp >> input;
+         pressure_precond = preconditioner_type (input);
+      }
+      else if (input == "p_tol")
+         inp >> pressure_tol;
+      else if (input == "p_max_iter")
+         inp >> pressure_max_iter;
+      else if (input == "p_unconverged")
+      {
+         inp >> input;
+         if (input == "continue")
+            pressure_continue = true;
+         else if (input == "abort")
+            pressure_continue = false;
+         else
+         {
+            cout << "Unknown p_unconverged " << input << endl;
+            abort ();
+         }
+      }
+      else
+      {
+         cout << "Unknown input " << input << endl;
+         abort ();
+      }
+   }
+   assert (pressure_tol > 0.0);
+   assert (pressure_max_iter > 0);
+
    inp.close ();
 
    cout << "Scheme order           = " << order << endl;
@@ -408,6 +481,11 @@ void ReservoirProblem::read_input ()
    cout << "Number of boundaries   = " << grid.n_boundary << endl;
    cout << "Number of cells        = " << grid.n_cells << endl;
    cout << "Number of actual cells = " << (grid.nx-1)*(grid.ny-1) << endl;
+   cout << "Pressure precond.      = " << preconditioner_names[pressure_precond] << endl;
+   cout << "Pressure tolerance     = " << pressure_tol << endl;
+   cout << "Pressure max. iter     = " << pressure_max_iter << endl;
+   cout << "Unconverged pressure   = "
+        << (pressure_continue ? "continue" : "abort") << endl;
 
 }
 
@@ -474,6 +552,10 @@ void ReservoirProblem::initialize ()
    pressure.allocate      (grid.nx+1, grid.ny+1);
    permeability.allocate  (grid.nx+1, grid.ny+1);
 
+   // r > 0, so that no entry matches before it is first set
+   ArgminCache empty = {-1.0, 0.0, 0.0};
+   argmin_cache.assign (2 * (grid.nx+1) * (grid.ny+1), empty);
+
    // rock permeability
    Permeability::N = 50;
    Permeability::xl.resize(Permeability::N);
@@ -530,7 +612,9 @@ void ReservoirProblem::residual (Matrix& s_residual, Matrix& c_residual)
 {
    unsigned int i, j;
    double velocity;
-   vector<double> state_left(3), state_right(3), flux(2);
+   State state_left, state_right;
+   Flux flux;
+   unsigned int n_min = 0; // states whose flux has an interior minimum
 
    s_residual = 0.0;
    c_residual = 0.0;
@@ -545,13 +629,14 @@ void ReservoirProblem::residual (Matrix& s_residual, Matrix& c_residual)
          state_left  = reconstruct (i-2, j, i-1, j, i, j);
          state_right = reconstruct (i+1, j, i, j, i-1, j);
          velocity    = darcy_velocity (i-1, j, i, j, 0.0);
-         flux        = num_flux (velocity, state_left, state_right, 0.0);
+         flux        = num_flux (velocity, state_left, state_right, 0.0,
+                                 0, n_min);
 
-         s_residual (i-1,j) += flux[0] * grid.dy;
-         s_residual (i,  j) -= flux[0] * grid.dy;
+         s_residual (i-1,j) += flux.water * grid.dy;
+         s_residual (i,  j) -= flux.water * grid.dy;
 
-         c_residual (i-1,j) += flux[1] * grid.dy;
-         c_residual (i,  j) -= flux[1] * grid.dy;
+         c_residual (i-1,j) += flux.polymer * grid.dy;
+         c_residual (i,  j) -= flux.polymer * grid.dy;
       }
 
    // interior horizontal faces
@@ -561,13 +646,14 @@ void ReservoirProblem::residual (Matrix& s_residual, Matrix& c_residual)
          state_left  = reconstruct (i, j-2, i, j-1, i, j);
          state_right = reconstruct (i, j+1, i, j, i, j-1);
          velocity    = darcy_velocity (i, j-1, i, j, gravity);
-         flux        = num_flux (velocity, state_left, state_right, gravity);
+         flux        = num_flux (velocity, state_left, state_right, gravity,
+                                 face_cache (i, j), n_min);
 
-         s_residual (i,j)   -= flux[0] * grid.dx;
-         s_residual (i,j-1) += flux[0] * grid.dx;
+         s_residual (i,j)   -= flux.water * grid.dx;
+         s_residual (i,j-1) += flux.water * grid.dx;
 
-         c_residual (i,j)   -= flux[1] * grid.dx;
-         c_residual (i,j-1) += flux[1] * grid.dx;
+         c_residual (i,j)   -= flux.polymer * grid.dx;
+         c_residual (i,j-1) += flux.polymer * grid.dx;
       }
 
    // inlet/outlet boundaries
@@ -586,18 +672,20 @@ void ReservoirProblem::residual (Matrix& s_residual, Matrix& c_residual)
                state_left  = reconstruct (i-1, j, i-1, j, i, j);
                state_right = reconstruct (i+1, j, i, j, i-1, j);
                velocity    = darcy_velocity (i-1, j, i, j, 0.0);
-               flux        = num_flux (velocity, state_left, state_right, 0.0);
-               s_residual(i,j) -= flux[0] * grid.dy;
-               c_residual(i,j) -= flux[1] * grid.dy;
+               flux        = num_flux (velocity, state_left, state_right, 0.0,
+                                       0, n_min);
+               s_residual(i,j) -= flux.water * grid.dy;
+               c_residual(i,j) -= flux.polymer * grid.dy;
             }
             else // outlet-vertical side
             {
                state_left  = reconstruct (i-2, j, i-1, j, i, j);
                state_right = reconstruct (i, j, i, j, i-1, j);
                velocity    = darcy_velocity (i-1, j, i, j, 0.0);
-               flux        = num_flux (velocity, state_left, state_right, 0.0);
-               s_residual(i-1,j) += flux[0] * grid.dy;
-               c_residual(i-1,j) += flux[1] * grid.dy;
+               flux        = num_flux (velocity, state_left, state_right, 0.0,
+                                       0, n_min);
+               s_residual(i-1,j) += flux.water * grid.dy;
+               c_residual(i-1,j) += flux.polymer * grid.dy;
             }
          }
       }
@@ -613,23 +701,27 @@ void ReservoirProblem::residual (Matrix& s_residual, Matrix& c_residual)
                state_left  = reconstruct (i, j-1, i, j-1, i, j);
                state_right = reconstruct (i, j+1, i, j, i, j-1);
                velocity    = darcy_velocity (i, j-1, i, j, gravity);
-               flux        = num_flux (velocity, state_left, state_right, gravity);
-               s_residual(i,j) -= flux[0] * grid.dx;
-               c_residual(i,j) -= flux[1] * grid.dx;
+               flux        = num_flux (velocity, state_left, state_right, gravity,
+                                       face_cache (i, j), n_min);
+               s_residual(i,j) -= flux.water * grid.dx;
+               c_residual(i,j) -= flux.polymer * grid.dx;
             }
             else // outlet-horizontal side
             {
                state_left  = reconstruct (i, j-2, i, j-1, i, j);
                state_right = reconstruct (i, j, i, j, i, j-1);
                velocity    = darcy_velocity (i, j-1, i, j, gravity);
-               flux        = num_flux (velocity, state_left, state_right, gravity);
-               s_residual(i,j-1) += flux[0] * grid.dx;
-               c_residual(i,j-1) += flux[1] * grid.dx;
+               flux        = num_flux (velocity, state_left, state_right, gravity,
+                                       face_cache (i, j), n_min);
+               s_residual(i,j-1) += flux.water * grid.dx;
+               c_residual(i,j-1) += flux.polymer * grid.dx;
             }
          }
       }
    }
 
+   n_interior_min = n_min;
+
    dt = cfl * max (grid.dx, grid.dy) / (3.0 * max_velocity);
    double lambda = dt / (grid.dx * grid.dy);
    s_residual *= lambda;
@@ -772,27 +864,34 @@ void ReservoirProblem::solve ()
 {
    unsigned int iter = 0;
    double time = 0.0;
-   PressureProblem pressure_problem (&grid);
+   PressureProblem pressure_problem (&grid, pressure_precond,
+                                     pressure_tol, pressure_max_iter);
    Matrix s_residual (grid.nx+1, grid.ny+1);
    Matrix c_residual (grid.nx+1, grid.ny+1);
    Matrix sc         (grid.nx+1, grid.ny+1);
    Matrix s_old      (grid.nx+1, grid.ny+1);
    Matrix sc_old     (grid.nx+1, grid.ny+1);
+   clock_t transport_clock = 0;
 
    while (iter < max_iter)
    {
       s_old = saturation;
       sc_old= saturation * concentration;
 
-      // solve for pressure
-      pressure_problem.run (saturation, concentration, 
-                            permeability, pressure);
+      // solve for pressure; if it does not converge, stop unless asked to
+      // go on with the last iterate
+      if (!pressure_problem.run (saturation, concentration, 
+                                 permeability, pressure))
+      {
+         if (!pressure_continue)
+            abort ();
+         cout << "Continuing with unconverged pressure" << endl;
+      }
 
       // Runge-Kutta stages
+      const clock_t t0 = clock ();
       for (unsigned int irk=0; irk<nrk; ++irk)
       {
-         n_interior_min = 0; // reset counter
-
          // compute residual
          residual (s_residual, c_residual);
       
@@ -809,6 +908,7 @@ void ReservoirProblem::solve ()
          // update solution in ghost cells
          updateGhostCells ();
       }
+      transport_clock += clock () - t0;
 
       // find solution range: to check for stability
       findMinMax ();
@@ -824,6 +924,15 @@ void ReservoirProblem::solve ()
       cout << "No. of interior min flux = " << n_interior_min << endl;
       cout << endl;
    }
+
+   // speed of the saturation/concentration update: each RK stage updates
+   // every cell once
+   const double transport_time = double(transport_clock) / CLOCKS_PER_SEC;
+   const double cell_updates = double(grid.nx-1) * (grid.ny-1) * nrk * iter;
+   cout << "Transport time         = " << transport_time << " s" << endl;
+   if (transport_time > 0.0)
+      cout << "Transport cells/s      = " << cell_updates / transport_time
+           << endl;
 }
 
 //------------------------------------------------------------------------------
@@ -2,11 +2,37 @@
 #define __RESERVOIR_H__
 
 #include <string>
+#include <vector>
 #include "matrix.h"
 #include "grid.h"
+#include "precond.h"
 
 #define SZERO 0.001
 
+// reconstructed state on one side of a face
+struct State
+{
+   double saturation, concentration, permeability;
+};
+
+// numerical flux of water and polymer across a face
+struct Flux
+{
+   double water, polymer;
+};
+
+// location of the minimum of the flux on one side of a face, and the r, z it
+// was found for; see dflu_saturation
+struct ArgminCache
+{
+   double r, z, s_min;
+};
+
+// numerical flux function: velocity, left and right states, gravity, cache
+// for the left and right states of the face or 0, and a counter of the
+// states whose flux has an interior minimum
+typedef Flux (*FluxFunction) (const double&, const State&, const State&,
+                              const double&, ArgminCache*, unsigned int&);
 
 // Class for reservoir problem
 class ReservoirProblem
@@ -22,11 +48,18 @@ class ReservoirProblem
       unsigned int nrk;
       unsigned int order;
       std::string  flux_type;
+      FluxFunction num_flux;
       double  ark[3], brk[3];
       double  cfl, final_time, dt;
       double  min_velocity;
       double  max_velocity;
       double  cinlet;
+      PreconditionerType pressure_precond;
+      double  pressure_tol;
+      unsigned int pressure_max_iter;
+      bool    pressure_continue; // go on if pressure does not converge
+      unsigned int n_interior_min;
+      std::vector<ArgminCache> argmin_cache; // two per horizontal face
       Grid    grid;
       Matrix  saturation;
       Matrix  concentration;
@@ -40,7 +73,7 @@ class ReservoirProblem
       void solve ();
       void output (const unsigned int) const;
 
-      std::vector<double> reconstruct
+      State reconstruct
        (
        const unsigned int& ill,
        const unsigned int& jll,
@@ -50,7 +83,7 @@ class ReservoirProblem
        const unsigned int& jr
        ) const;
 
-      std::vector<double> reconstruct1
+      State reconstruct1
        (
        const unsigned int& ill,
        const unsigned int& jll,
@@ -60,7 +93,7 @@ class ReservoirProblem
        const unsigned int& jr
        ) const;
 
-      std::vector<double> reconstruct2
+      State reconstruct2
        (
        const unsigned int& ill,
        const unsigned int& jll,
@@ -75,14 +108,10 @@ class ReservoirProblem
           const unsigned int&, const unsigned int&,
           const double&);
 
-      std::vector<double> num_flux
-       (
-       const double& velocity,
-       const std::vector<double>& state_left,
-       const std::vector<double>& state_right,
-       const double& g
-       );
-       
+      ArgminCache* face_cache (const unsigned int i, const unsigned int j)
+      {
+         return &argmin_cache[2 * (i + (grid.nx+1) * j)];
+      }
 
       void updateConcentration (Matrix&);
       void updateGhostCells ();
@@ -92,15 +121,23 @@ class ReservoirProblem
 
 double minmod (const double& ul, const double& u0, const double& ur);
 
-std::vector<double> dflu_flux
+Flux dflu_flux
        (
        const double& velocity,
-       const std::vector<double>& state_left,
-       const std::vector<double>& state_right,
-       const double& g
+       const State& state_left,
+       const State& state_right,
+       const double& g,
+       ArgminCache* cache,
+       unsigned int& n_interior_min
        );
        
-double argmin_flux(const double& concentration,
-                   const double& permeability,
-                   const double& velocity);
+double argmin_flux(const double& r, const double& z);
+
+double dflu_saturation(const double& saturation,
+                       const double& concentration,
+                       const double& permeability,
+                       const double& velocity,
+                       const bool    left,
+                       ArgminCache*  cache,
+                       unsigned int& n_interior_min);
 #endif
@@ -0,0 +1,32 @@
+#include "stencil.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// allocate stencil for nx x ny cells, all coefficients zero
+//------------------------------------------------------------------------------
+void Stencil::allocate (const unsigned int nx_in, const unsigned int ny_in)
+{
+   nx = nx_in;
+   ny = ny_in;
+   ap.assign ((nx+2)*(ny+2), 0.0);
+   ae.assign ((nx+2)*(ny+2), 0.0);
+   an.assign ((nx+2)*(ny+2), 0.0);
+}
+
+//------------------------------------------------------------------------------
+// result = A * p in the cells; p and result are Matrix(nx+2,ny+2) and the
+// halo of result is not touched
+//------------------------------------------------------------------------------
+void Stencil::multiply (const Matrix& p, Matrix& result) const
+{
+   const unsigned int s = nx + 2;
+
+   for(unsigned int j=1; j<=ny; ++j)
+      for(unsigned int i=1; i<=nx; ++i)
+      {
+         const unsigned int c = index(i,j);
+         result(i,j) = ap[c] * p(i,j) - ae[c-1] * p(i-1,j) - ae[c] * p(i+1,j)
+                                      - an[c-s] * p(i,j-1) - an[c] * p(i,j+1);
+      }
+}
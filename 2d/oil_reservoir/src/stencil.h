@@ -0,0 +1,29 @@
+#ifndef __STENCIL_H__
+#define __STENCIL_H__
+
+#include <vector>
+#include "matrix.h"
+
+// Five point operator on nx x ny cells, numbered from 1, with one layer of
+// halo cells around them
+//    (A p)(i,j) = ap(i,j) p(i,j) - ae(i-1,j) p(i-1,j) - ae(i,j) p(i+1,j)
+//                                - an(i,j-1) p(i,j-1) - an(i,j) p(i,j+1)
+// The arrays are stored like a Matrix(nx+2,ny+2), with index i + (nx+2)*j.
+// ae and an are zero on the halo so that no cell needs special treatment.
+class Stencil
+{
+   public:
+      Stencil () { nx = ny = 0; };
+      ~Stencil () {};
+      void allocate (const unsigned int, const unsigned int);
+      void multiply (const Matrix& p, Matrix& result) const;
+      unsigned int index (const unsigned int i, const unsigned int j) const
+      {
+         return i + (nx+2) * j;
+      }
+
+      unsigned int nx, ny;
+      std::vector<double> ap, ae, an;
+};
+
+#endif
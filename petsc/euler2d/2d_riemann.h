@@ -9,6 +9,7 @@ const double ymin = 0.0, ymax = 1.0;
 const double gas_gamma = 1.4;
 const double gas_const = 1.0;
 const int has_exact_sol = 0;
+const int steady_bc = 1; // boundary_value does not depend on time
 const double final_time = 0.8;
 
 // 2-D Riemann
@@ -0,0 +1,41 @@
+//------------------------------------------------------------------------------
+// Checkpoint files for restarting a run. The solution vector is written with
+// the PETSc binary viewer, which stores a DMDA vector in the natural ordering
+// of the whole grid, so a checkpoint can be read with any number of processes.
+// It is followed by the time, the number of time steps, the time step and the
+// number of solution files written so far.
+//------------------------------------------------------------------------------
+#define NCHK 4
+
+PetscErrorCode write_checkpoint(const char *filename, Vec ug, PetscReal t,
+                                PetscInt step, PetscReal dt, int c)
+{
+   PetscErrorCode ierr;
+   PetscViewer    viewer;
+   PetscReal      data[NCHK];
+
+   data[0] = t; data[1] = step; data[2] = dt; data[3] = c;
+   ierr = PetscViewerBinaryOpen(PETSC_COMM_WORLD, filename, FILE_MODE_WRITE, &viewer); CHKERRQ(ierr);
+   ierr = VecView(ug, viewer); CHKERRQ(ierr);
+   ierr = PetscViewerBinaryWrite(viewer, data, NCHK, PETSC_REAL); CHKERRQ(ierr);
+   ierr = PetscViewerDestroy(&viewer); CHKERRQ(ierr);
+   PetscPrintf(PETSC_COMM_WORLD,"Checkpoint %s: step = %d, t = %e\n", filename, step, t);
+   return(0);
+}
+
+// ug must be created from a DMDA with the same global grid as when writing
+PetscErrorCode read_checkpoint(const char *filename, Vec ug, PetscReal *t,
+                               PetscInt *step, PetscReal *dt, int *c)
+{
+   PetscErrorCode ierr;
+   PetscViewer    viewer;
+   PetscReal      data[NCHK];
+
+   ierr = PetscViewerBinaryOpen(PETSC_COMM_WORLD, filename, FILE_MODE_READ, &viewer); CHKERRQ(ierr);
+   ierr = VecLoad(ug, viewer); CHKERRQ(ierr);
+   ierr = PetscViewerBinaryRead(viewer, data, NCHK, NULL, PETSC_REAL); CHKERRQ(ierr);
+   ierr = PetscViewerDestroy(&viewer); CHKERRQ(ierr);
+   *t = data[0]; *step = (PetscInt)data[1]; *dt = data[2]; *c = (int)data[3];
+   PetscPrintf(PETSC_COMM_WORLD,"Restart from %s: step = %d, t = %e\n", filename, *step, *t);
+   return(0);
+}
@@ -3,6 +3,9 @@ static char help[] = "Solves 2d Euler equations.\n\n";
 #include <petscdm.h>
 #include <petscdmda.h>
 #include <petscts.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 // Number of variables at each grid point
 #define nvar  4
@@ -30,11 +33,44 @@ void con2prim(const double *Con, double *Prim);
 const PetscInt sw = 3; // stencil width, 3 on either side, for weno5
 double dx, dy;
 
+#include "savevtk.h"
+#include "checkpoint.h"
+
+// Residual kernels: one face at a time, or face-batched
+typedef enum { kernel_scalar, kernel_batched } Kernel;
+const char *const Kernels[] = {"scalar", "batched", "Kernel", "kernel_", NULL};
+
+// One side of the domain, in the order left, right, bottom, top. Ghost layer
+// g=0,...,sw-1 is at index first+step*g along the normal.
+typedef struct
+{
+   enum bctype type;
+   PetscBool   owned;        // this rank has cells along this side
+   int         dir;          // direction of normal, 0 for x, 1 for y
+   PetscInt    first, step;  // first ghost layer, step going outwards
+   PetscInt    t0, t1;       // owned cells along the side
+   double      c0;           // normal coordinate of first ghost layer
+   double      *cache;       // farfield values when steady_bc is set
+} Side;
+
 typedef struct
 {
    PetscReal dt, cfl, Tf;
    PetscInt  max_steps, si;
-   Vec       fxp, fxm, fyp, fym;
+   PetscInt  ci, step0;          // checkpoint interval, first time step
+   Kernel    kernel;
+   Vec       fxp, fxm, fyp, fym; // only for the scalar kernel
+   PetscReal *fx, *fy;           // line buffers for the batched kernel
+   PetscInt  lfx, lfy;           // length of line buffers of each thread
+   int       nthreads;
+   PetscInt  tile_x, tile_y;     // tile size of batched kernel, 0 for no tiling
+   PetscBool lag;                // use wave speeds from previous reduction
+                                 // (default), otherwise wait for current one
+   PetscReal safety;             // factor on the lagged wave speeds
+   PetscReal lamloc[3], lam[3];  // local, global max of lambdax, lambday, 1/dt
+   MPI_Request req;              // pending reduction of lam
+   Side      side[4];
+   Output    out;
 } AppCtx;
 
 extern PetscErrorCode RHSFunction(TS,PetscReal,Vec,Vec,void*);
@@ -222,6 +258,32 @@ void compute_lambda(const double *Con, double *lambdax, double *lambday)
    *lambday = fabs(vy) + a;
 }
 
+// Maximum over owned cells of the wave speeds along x and y, and of the
+// inverse of the local timestep, 1/dt_local
+void max_speeds(PetscScalar ***u, PetscInt ibeg, PetscInt jbeg,
+                PetscInt nlocx, PetscInt nlocy, double *lam)
+{
+   double lamx, lamy, l0 = 0.0, l1 = 0.0, l2 = 0.0;
+#pragma omp parallel for private(lamx,lamy) reduction(max:l0,l1,l2)
+   for(PetscInt j=jbeg; j<jbeg+nlocy; ++j)
+      for(PetscInt i=ibeg; i<ibeg+nlocx; ++i)
+      {
+         compute_lambda(u[j][i], &lamx, &lamy);
+         l0 = PetscMax(l0, lamx);
+         l1 = PetscMax(l1, lamy);
+         l2 = PetscMax(l2, lamx/dx + lamy/dy);
+      }
+   lam[0] = l0; lam[1] = l1; lam[2] = l2;
+}
+
+// Part [*b,*e) of the n items starting at b0, for thread t of nt
+static inline void thread_range(PetscInt b0, PetscInt n, int t, int nt,
+                                PetscInt *b, PetscInt *e)
+{
+   *b = b0 + (n*t)/nt;
+   *e = b0 + (n*(t+1))/nt;
+}
+
 // Compute local timestep
 double dt_local(const double *Con)
 {
@@ -251,8 +313,209 @@ void split_fluxes(const double *U, const double nx, const double ny,
    }
 }
 
+// Same as split_fluxes for n consecutive cells of a row. U[d] points to
+// variable d of the first cell, fp[d] and fm[d] are contiguous arrays.
+void split_fluxes_row(const double nx, const double ny, const double lambda,
+                      const int n, double *U[nvar], double *fp[nvar], double *fm[nvar])
+{
+   for(int i=0; i<n; ++i)
+   {
+      const int    k  = nvar*i;
+      const double P1 = U[1][k]/U[0][k];
+      const double P2 = U[2][k]/U[0][k];
+      const double P3 = (U[3][k] - 0.5*U[0][k]*(P1*P1 + P2*P2))*(gas_gamma-1.0);
+      double flux[nvar];
+      flux[0] = U[1][k]*nx + U[2][k]*ny;
+      flux[1] = P3*nx + P1*flux[0];
+      flux[2] = P3*ny + P2*flux[0];
+      flux[3] = (U[3][k] + P3) * (P1*nx + P2*ny);
+
+      for(int d=0; d<nvar; ++d)
+      {
+         fp[d][i] = 0.5*(flux[d] + lambda * U[d][k]);
+         fm[d][i] = 0.5*(flux[d] - lambda * U[d][k]);
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+// Face-batched characteristic WENO flux
+// NB consecutive faces along a grid line are processed together, one SIMD lane
+// per face. The formulae are the same as in the scalar path, with the squares
+// written out, so both give the same residual.
+//------------------------------------------------------------------------------
+#define NB 8
+
+// Weno reconstruction on NB lanes, v[0..4] = um2, um1, u0, up1, up2
+static inline void weno_lanes(double v[5][NB], double *res)
+{
+   const double eps = 1.0e-6;
+   const double gamma1=1.0/10.0, gamma2=3.0/5.0, gamma3=3.0/10.0;
+
+   for(int l=0; l<NB; ++l)
+   {
+      const double um2 = v[0][l], um1 = v[1][l], u0 = v[2][l];
+      const double up1 = v[3][l], up2 = v[4][l];
+      const double a1 = um2 - 2.0*um1 + u0, b1 = um2 - 4.0*um1 + 3.0*u0;
+      const double a2 = um1 - 2.0*u0 + up1, b2 = um1 - up1;
+      const double a3 = u0 - 2.0*up1 + up2, b3 = 3.0*u0 - 4.0*up1 + up2;
+      const double beta1 = (13.0/12.0)*(a1*a1) + (1.0/4.0)*(b1*b1);
+      const double beta2 = (13.0/12.0)*(a2*a2) + (1.0/4.0)*(b2*b2);
+      const double beta3 = (13.0/12.0)*(a3*a3) + (1.0/4.0)*(b3*b3);
+#if defined(WENOJS)
+      const double t1 = eps+beta1, t2 = eps+beta2, t3 = eps+beta3;
+      const double w1 = gamma1 / (t1*t1);
+      const double w2 = gamma2 / (t2*t2);
+      const double w3 = gamma3 / (t3*t3);
+#elif defined(WENOZ)
+      const double tau = fabs(beta1 - beta3);
+      const double t1 = tau/(eps+beta1), t2 = tau/(eps+beta2), t3 = tau/(eps+beta3);
+      const double w1 = gamma1 * (1.0 + t1*t1);
+      const double w2 = gamma2 * (1.0 + t2*t2);
+      const double w3 = gamma3 * (1.0 + t3*t3);
+#endif
+      const double u1 = (1.0/3.0)*um2 - (7.0/6.0)*um1 + (11.0/6.0)*u0;
+      const double u2 = -(1.0/6.0)*um1 + (5.0/6.0)*u0 + (1.0/3.0)*up1;
+      const double u3 = (1.0/3.0)*u0 + (5.0/6.0)*up1 - (1.0/6.0)*up2;
+
+      res[l] = (w1 * u1 + w2 * u2 + w3 * u3)/(w1 + w2 + w3);
+   }
+}
+
+// Eigenvector matrices at the averaged state of NB faces, normal along x
+// (dir=0) or y (dir=1); wl, wr are the states left and right of the faces.
+static inline void eigenvectors_lanes(const int dir,
+                                      double wl[nvar][NB], double wr[nvar][NB],
+                                      double R[nvar][nvar][NB],
+                                      double L[nvar][nvar][NB])
+{
+   const double g1 = gas_gamma - 1.0;
+
+   for(int l=0; l<NB; ++l)
+   {
+      // Same as avg_prim_to_con
+      const double ul1 = wl[1][l]/wl[0][l], ul2 = wl[2][l]/wl[0][l];
+      const double ur1 = wr[1][l]/wr[0][l], ur2 = wr[2][l]/wr[0][l];
+      const double pl = (wl[3][l] - 0.5*wl[0][l]*(ul1*ul1 + ul2*ul2))*(gas_gamma-1.0);
+      const double pr = (wr[3][l] - 0.5*wr[0][l]*(ur1*ur1 + ur2*ur2))*(gas_gamma-1.0);
+      const double ra = 0.5*(wl[0][l] + wr[0][l]);
+      const double ua = 0.5*(ul1 + ur1);
+      const double va = 0.5*(ul2 + ur2);
+      const double pa = 0.5*(pl + pr);
+      const double W1 = ra*ua, W2 = ra*va;
+      const double W3 = 0.5*ra*(ua*ua + va*va) + pa/(gas_gamma-1.0);
+
+      // Same as eigenvector_matrix_x/y
+      const double rho  = ra;
+      const double E    = W3;
+      const double u    = W1 / rho;
+      const double v    = W2 / rho;
+      const double q2   = u*u + v*v;
+      const double p    = g1 * (E - 0.5 * rho * q2);
+      const double c2   = gas_gamma * p / rho;
+      const double c    = sqrt(c2);
+      const double beta = 0.5/c2;
+      const double phi2 = 0.5*g1*q2;
+      const double h    = c2/g1 + 0.5*q2;
+      const double un   = dir == 0 ? u : v; // normal velocity
+
+      R[0][0][l] = 1;      R[0][1][l] = 0;     R[0][2][l] = 1;      R[0][3][l] = 1;
+      R[1][0][l] = u;      R[2][0][l] = v;     R[3][0][l] = 0.5*q2;
+      R[3][2][l] = h+c*un; R[3][3][l] = h-c*un;
+
+      L[0][0][l] = 1-phi2/c2;        L[0][1][l] = g1*u/c2;
+      L[0][2][l] = g1*v/c2;          L[0][3][l] = -g1/c2;
+      L[1][3][l] = 0;
+      L[2][0][l] = beta*(phi2-c*un); L[3][0][l] = beta*(phi2+c*un);
+      L[2][3][l] = beta*g1;          L[3][3][l] = beta*g1;
+
+      R[1][1][l] = dir == 0 ? 0     : 1;
+      R[2][1][l] = dir == 0 ? -1    : 0;
+      R[3][1][l] = dir == 0 ? -v    : u;
+      R[1][2][l] = dir == 0 ? u+c   : u;
+      R[1][3][l] = dir == 0 ? u-c   : u;
+      R[2][2][l] = dir == 0 ? v     : v+c;
+      R[2][3][l] = dir == 0 ? v     : v-c;
+
+      L[1][0][l] = dir == 0 ? v     : -u;
+      L[1][1][l] = dir == 0 ? 0     : 1;
+      L[1][2][l] = dir == 0 ? -1    : 0;
+      L[2][1][l] = dir == 0 ? beta*(c-g1*u) : -beta*g1*u;
+      L[2][2][l] = dir == 0 ? -beta*g1*v    : beta*(c-g1*v);
+      L[3][1][l] = dir == 0 ?-beta*(c+g1*u) : -beta*g1*u;
+      L[3][2][l] = dir == 0 ? -beta*g1*v    :-beta*(c+g1*v);
+   }
+}
+
+// Numerical flux at nf <= NB consecutive faces along a grid line.
+// fp[k][d], fm[k][d] point to variable d of the split fluxes of cell i-3+k,
+// k=0..5, for the first face (between i-1 and i), contiguous along the faces.
+// ul[d], ur[d] point to the states of cells i-1 and i, nvar doubles apart.
+void weno_flux_batch(const int dir, const int nf,
+                     double *fp[6][nvar], double *fm[6][nvar],
+                     double *ul[nvar], double *ur[nvar],
+                     double flux[nvar][NB])
+{
+   double R[nvar][nvar][NB], L[nvar][nvar][NB];
+   double gp[6][nvar][NB], gm[6][nvar][NB], wl[nvar][NB], wr[nvar][NB];
+   double v[5][NB], wp[nvar][NB], wm[nvar][NB];
+   int    k, r, c, l, m;
+
+   // Gather states and split fluxes into lanes; lanes beyond nf repeat the
+   // last face.
+   for(c=0; c<nvar; ++c)
+      for(l=0; l<NB; ++l)
+      {
+         m = nvar*(nf == NB ? l : PetscMin(l,nf-1));
+         wl[c][l] = ul[c][m];
+         wr[c][l] = ur[c][m];
+      }
+   for(k=0; k<6; ++k)
+      for(c=0; c<nvar; ++c)
+         for(l=0; l<NB; ++l)
+         {
+            m = nf == NB ? l : PetscMin(l,nf-1);
+            gp[k][c][l] = fp[k][c][m];
+            gm[k][c][l] = fm[k][c][m];
+         }
+
+   eigenvectors_lanes(dir, wl, wr, R, L);
+
+   for(r=0; r<nvar; ++r)
+   {
+      // positive flux: project cells i-3..i+1 onto characteristic field r
+      for(k=0; k<5; ++k)
+         for(l=0; l<NB; ++l)
+         {
+            double s = 0;
+            for(c=0; c<nvar; ++c) s += L[r][c][l]*gp[k][c][l];
+            v[k][l] = s;
+         }
+      weno_lanes(v, wp[r]);
+
+      // negative flux: cells i+2..i-2
+      for(k=0; k<5; ++k)
+         for(l=0; l<NB; ++l)
+         {
+            double s = 0;
+            for(c=0; c<nvar; ++c) s += L[r][c][l]*gm[5-k][c][l];
+            v[k][l] = s;
+         }
+      weno_lanes(v, wm[r]);
+   }
+
+   // Total flux
+   for(c=0; c<nvar; ++c)
+      for(l=0; l<NB; ++l)
+      {
+         double s = 0;
+         for(r=0; r<nvar; ++r) s += R[c][r][l]*(wp[r][l] + wm[r][l]);
+         flux[c][l] = s;
+      }
+}
+
 //------------------------------------------------------------------------------
-PetscErrorCode savesol(double t, DM da, Vec ug)
+PetscErrorCode savesol(double t, DM da, Vec ug, Output *out)
 {
    PetscErrorCode ierr;
    char           filename[32] = "sol";
@@ -261,7 +524,13 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    FILE           *fp;
    Vec            ul;
    PetscScalar    ***u;
-   static int     c = 0;
+
+   if(out->format == output_vtk)
+   {
+      ierr = savevtk(out, out->c, t, da, ug); CHKERRQ(ierr);
+      ++out->c;
+      return(0);
+   }
 
    ierr = DMGetLocalVector(da, &ul); CHKERRQ(ierr);
    ierr = DMGlobalToLocalBegin(da, ug, INSERT_VALUES, ul); CHKERRQ(ierr);
@@ -274,7 +543,7 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    int jend = PetscMin(jbeg+nlocy+1, ny);
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
-   sprintf(filename, "sol-%03d-%03d.plt", c, rank);
+   sprintf(filename, "sol-%03d-%03d.plt", out->c, rank);
    fp = fopen(filename,"w");
    fprintf(fp, "TITLE = \"u_t + u_x + u_y = 0\"\n");
    fprintf(fp, "VARIABLES = x, y, rho, u, v, p\n");
@@ -293,306 +562,19 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    ierr = DMDAVecRestoreArrayDOFRead(da, ul, &u); CHKERRQ(ierr);
    ierr = DMRestoreLocalVector(da, &ul); CHKERRQ(ierr);
 
-   ++c;
+   ++out->c;
    return(0);
 }
 
-// The rhs function in du/dt = R(t,u)
-PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
+// Add flux differences to res, one face at a time
+void fluxes_scalar(PetscScalar ***u, PetscScalar ***fxp, PetscScalar ***fxm,
+                   PetscScalar ***fyp, PetscScalar ***fym, PetscScalar ***res,
+                   PetscInt ibeg, PetscInt jbeg, PetscInt nlocx, PetscInt nlocy)
 {
-   AppCtx*        ctx = (AppCtx*) ptr;
-   DM             da;
-   Vec            localU;
-   PetscScalar    ***u;
-   PetscScalar    ***res;
-   PetscScalar    ***fxp;
-   PetscScalar    ***fxm;
-   PetscScalar    ***fyp;
-   PetscScalar    ***fym;
-   PetscInt       i, j, ibeg, jbeg, nlocx, nlocy, d, nx, ny;
-   PetscReal      fp[nvar], fm[nvar], flux1[nvar], flux[nvar], lamx, lamy, lambdax, lambday;
-   PetscReal      fim3[nvar], fim2[nvar], fim1[nvar], fi[nvar], fip1[nvar];
-   PetscReal      uavg[nvar], Rm[nvar][nvar], Lm[nvar][nvar], idx, idy;
-   PetscErrorCode ierr;
-
-   ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
-   ierr = DMGetLocalVector(da,&localU); CHKERRQ(ierr);
-   ierr = DMGlobalToLocalBegin(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
-   ierr = DMGlobalToLocalEnd(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
-   ierr = DMDAVecGetArrayDOF(da, localU, &u); CHKERRQ(ierr);
-   ierr = DMDAVecGetArrayDOF(da, R, &res); CHKERRQ(ierr);
-
-   ierr = DMDAVecGetArrayDOF(da, ctx->fxp, &fxp); CHKERRQ(ierr);
-   ierr = DMDAVecGetArrayDOF(da, ctx->fxm, &fxm); CHKERRQ(ierr);
-   ierr = DMDAVecGetArrayDOF(da, ctx->fyp, &fyp); CHKERRQ(ierr);
-   ierr = DMDAVecGetArrayDOF(da, ctx->fym, &fym); CHKERRQ(ierr);
-
-   ierr = DMDAGetInfo(da,0,&nx,&ny,0,0,0,0,0,0,0,0,0,0); CHKERRQ(ierr);
-   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
-
-   // ---Begin res computation---
-
-   // Fill in ghost values based on boundary condition
-   // Left side
-   if(ibeg == 0 && BC_LEFT == wall)
-   {
-      i = -1;
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-      {
-         u[j][i][0] =  u[j][i+1][0];
-         u[j][i][1] = -u[j][i+1][1];
-         u[j][i][2] =  u[j][i+1][2];
-         u[j][i][3] =  u[j][i+1][3];
-
-         u[j][i-1][0] =  u[j][i+2][0];
-         u[j][i-1][1] = -u[j][i+2][1];
-         u[j][i-1][2] =  u[j][i+2][2];
-         u[j][i-1][3] =  u[j][i+2][3];
-
-         u[j][i-2][0] =  u[j][i+3][0];
-         u[j][i-2][1] = -u[j][i+3][1];
-         u[j][i-2][2] =  u[j][i+3][2];
-         u[j][i-2][3] =  u[j][i+3][3];
-      }
-
-   }
-   else if(ibeg == 0 && BC_LEFT == farfield)
-   {
-      PetscReal x = xmin - 0.5*dx;
-      i = -1;
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-      {
-         PetscReal y = ymin + j*dy + 0.5*dy;
-         boundary_value(time, x,      y, u[j][i]);
-         boundary_value(time, x-dx,   y, u[j][i-1]);
-         boundary_value(time, x-2*dx, y, u[j][i-2]);
-      }
-   }
-   else if(ibeg == 0 && BC_LEFT == neumann)
-   {
-      i = -1;
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-      {
-         for(d=0; d<nvar; ++d)
-         {
-            u[j][i][d]   =  u[j][i+1][d];
-            u[j][i-1][d] =  u[j][i+1][d];
-            u[j][i-2][d] =  u[j][i+1][d];
-         }
-      }
-   }
-   else if(ibeg == 0 && BC_LEFT == periodic)
-   {
-      // Nothing to do
-   }
-   else if(ibeg == 0)
-   {
-      SETERRQ(PETSC_COMM_WORLD,1,"Left bc is not implemented");
-   }
-
-   // Right side
-   if(ibeg+nlocx == nx && BC_RIGHT == wall)
-   {
-      i = nx;
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-      {
-         u[j][i][0] =  u[j][i-1][0];
-         u[j][i][1] = -u[j][i-1][1];
-         u[j][i][2] =  u[j][i-1][2];
-         u[j][i][3] =  u[j][i-1][3];
-
-         u[j][i+1][0] =  u[j][i-2][0];
-         u[j][i+1][1] = -u[j][i-2][1];
-         u[j][i+1][2] =  u[j][i-2][2];
-         u[j][i+1][3] =  u[j][i-2][3];
-
-         u[j][i+2][0] =  u[j][i-3][0];
-         u[j][i+2][1] = -u[j][i-3][1];
-         u[j][i+2][2] =  u[j][i-3][2];
-         u[j][i+2][3] =  u[j][i-3][3];
-      }
-
-   }
-   else if(ibeg+nlocx == nx && BC_RIGHT == farfield)
-   {
-      PetscReal x = xmax + 0.5*dx;
-      i = nx;
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-      {
-         PetscReal y = ymin + j*dy + 0.5*dy;
-         boundary_value(time, x,      y, u[j][i]);
-         boundary_value(time, x+dx,   y, u[j][i+1]);
-         boundary_value(time, x+2*dx, y, u[j][i+2]);
-      }
-   }
-   else if(ibeg+nlocx == nx && BC_RIGHT == neumann)
-   {
-      i = nx;
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-      {
-         for(d=0; d<nvar; ++d)
-         {
-            u[j][i][d]   =  u[j][i-1][d];
-            u[j][i+1][d] =  u[j][i-1][d];
-            u[j][i+2][d] =  u[j][i-1][d];
-         }
-      }
-   }
-   else if(ibeg+nlocx == nx && BC_RIGHT == periodic)
-   {
-      // Nothing to do
-   }
-   else if(ibeg+nlocx == nx)
-   {
-      SETERRQ(PETSC_COMM_WORLD,1,"Right bc is not implemented");
-   }
-
-   // Bottom side
-   if(jbeg == 0 && BC_BOTTOM == wall)
-   {
-      j = -1;
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         u[j][i][0] =  u[j+1][i][0];
-         u[j][i][1] =  u[j+1][i][1];
-         u[j][i][2] = -u[j+1][i][2];
-         u[j][i][3] =  u[j+1][i][3];
-
-         u[j-1][i][0] =  u[j+2][i][0];
-         u[j-1][i][1] =  u[j+2][i][1];
-         u[j-1][i][2] = -u[j+2][i][2];
-         u[j-1][i][3] =  u[j+2][i][3];
-
-         u[j-2][i][0] =  u[j+3][i][0];
-         u[j-2][i][1] =  u[j+3][i][1];
-         u[j-2][i][2] = -u[j+3][i][2];
-         u[j-2][i][3] =  u[j+3][i][3];
-      }
-
-   }
-   else if(jbeg == 0 && BC_BOTTOM == farfield)
-   {
-      PetscReal y = ymin - 0.5*dy;
-      j = -1;
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         PetscReal x = xmin + i*dx + 0.5*dx;
-         boundary_value(time, x, y,      u[j][i]);
-         boundary_value(time, x, y-dy,   u[j-1][i]);
-         boundary_value(time, x, y-2*dy, u[j-2][i]);
-      }
-   }
-   else if(jbeg == 0 && BC_BOTTOM == neumann)
-   {
-      j = -1;
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         for(d=0; d<nvar; ++d)
-         {
-            u[j][i][d]   = u[j+1][i][d];
-            u[j-1][i][d] = u[j+1][i][d];
-            u[j-2][i][d] = u[j+1][i][d];
-         }
-      }
-   }
-   else if(jbeg == 0 && BC_BOTTOM == periodic)
-   {
-      // Nothing to do
-   }
-   else if(jbeg == 0)
-   {
-      SETERRQ(PETSC_COMM_WORLD,1,"Bottom bc is not implemented");
-   }
-
-   // Top side
-   if(jbeg+nlocy == ny && BC_TOP == wall)
-   {
-      j = ny;
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         u[j][i][0] =  u[j-1][i][0];
-         u[j][i][1] =  u[j-1][i][1];
-         u[j][i][2] = -u[j-1][i][2];
-         u[j][i][3] =  u[j-1][i][3];
-
-         u[j+1][i][0] =  u[j-2][i][0];
-         u[j+1][i][1] =  u[j-2][i][1];
-         u[j+1][i][2] = -u[j-2][i][2];
-         u[j+1][i][3] =  u[j-2][i][3];
-
-         u[j+2][i][0] =  u[j-3][i][0];
-         u[j+2][i][1] =  u[j-3][i][1];
-         u[j+2][i][2] = -u[j-3][i][2];
-         u[j+2][i][3] =  u[j-3][i][3];
-      }
-
-   }
-   else if(jbeg+nlocy == ny && BC_TOP == farfield)
-   {
-      PetscReal y = ymax + 0.5*dy;
-      j = ny;
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         PetscReal x = xmin + i*dx + 0.5*dx;
-         boundary_value(time, x, y,      u[j][i]);
-         boundary_value(time, x, y+dy,   u[j+1][i]);
-         boundary_value(time, x, y+2*dy, u[j+2][i]);
-      }
-   }
-   else if(jbeg+nlocy == ny && BC_TOP == neumann)
-   {
-      j = ny;
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         for(d=0; d<nvar; ++d)
-         {
-            u[j][i][d]   = u[j-1][i][d];
-            u[j+1][i][d] = u[j-1][i][d];
-            u[j+2][i][d] = u[j-1][i][d];
-         }
-      }
-   }
-   else if(jbeg+nlocy == ny && BC_TOP == periodic)
-   {
-      // Nothing to do
-   }
-   else if(jbeg+nlocy == ny)
-   {
-      SETERRQ(PETSC_COMM_WORLD,1,"Top bc is not implemented");
-   }
-
-   // compute maximum wave speeds along x and y
-   // set residual to zero
-   lambdax = lambday = 0.0;
-   for(j=jbeg; j<jbeg+nlocy; ++j)
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         compute_lambda(u[j][i], &lamx, &lamy);
-         lambdax = PetscMax(lambdax, lamx);
-         lambday = PetscMax(lambday, lamy);
-
-         for(d=0; d<nvar; ++d)
-            res[j][i][d] = 0;
-      }
-   lamx = lambdax; lamy = lambday;
-   ierr = MPI_Allreduce(&lamx, &lambdax, 1, MPI_DOUBLE, MPI_MAX,
-                        PETSC_COMM_WORLD);  CHKERRQ(ierr);
-   ierr = MPI_Allreduce(&lamy, &lambday, 1, MPI_DOUBLE, MPI_MAX,
-                        PETSC_COMM_WORLD);  CHKERRQ(ierr);
-
-   // Compute x-split fluxes
-   for(j=jbeg; j<jbeg+nlocy; ++j)
-      for(i=ibeg-sw; i<ibeg+nlocx+sw; ++i)
-      {
-         split_fluxes(u[j][i], 1.0, 0.0, lambdax, fxp[j][i], fxm[j][i]);
-      }
-
-   // Compute y-split fluxes
-   for(j=jbeg-sw; j<jbeg+nlocy+sw; ++j)
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         split_fluxes(u[j][i], 0.0, 1.0, lambday, fyp[j][i], fym[j][i]);
-      }
+   PetscInt  i, j, d;
+   PetscReal fp[nvar], fm[nvar], flux1[nvar], flux[nvar];
+   PetscReal fim3[nvar], fim2[nvar], fim1[nvar], fi[nvar], fip1[nvar];
+   PetscReal uavg[nvar], Rm[nvar][nvar], Lm[nvar][nvar], idx, idy;
 
    // Minus sign needed because res is assembled on lhs, but petsc needs
    // it on rhs.
@@ -704,6 +686,429 @@ PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
             }
          }
       }
+}
+
+// Compute res for the cells [ib,ie) x [jb,je), NB faces at a time; res is set
+// to zero row by row before the x fluxes are added. Each cell is updated by its
+// own faces in the same order as in fluxes_scalar, so the result does not
+// depend on how the owned cells are split into blocks. The split fluxes are
+// computed one row at a time into the line buffers fx, fy.
+void fluxes_batched(double *fx, double *fy, PetscScalar ***u, PetscScalar ***res,
+                    const double lambdax, const double lambday,
+                    PetscInt ib, PetscInt ie, PetscInt jb, PetscInt je)
+{
+   const PetscInt n = ie - ib, lx = n + 2*sw;
+   PetscInt i, j, i0, k, l, d, nf, r;
+   double   *U[nvar], *fxp[nvar], *fxm[nvar], *fyp[6][nvar], *fym[6][nvar];
+   double   *fp[6][nvar], *fm[6][nvar], *ul[nvar], *ur[nvar];
+   double   flux[nvar][NB], idx, idy;
+
+   if(n <= 0 || je <= jb) return;
+
+   // Minus sign needed because res is assembled on lhs, but petsc needs
+   // it on rhs.
+   idx = -1.0/dx;
+   idy = -1.0/dy;
+
+   // x-split fluxes of cells ib-sw,...,ie+sw-1 of one row
+   for(d=0; d<nvar; ++d)
+   {
+      fxp[d] = fx + d*lx;
+      fxm[d] = fx + (nvar+d)*lx;
+   }
+
+   // x fluxes: faces i0,...,i0+nf-1 along row j
+   for(j=jb; j<je; ++j)
+   {
+      for(i=ib; i<ie; ++i)
+         for(d=0; d<nvar; ++d) res[j][i][d] = 0.0;
+      for(d=0; d<nvar; ++d) U[d] = &u[j][ib-sw][d];
+      split_fluxes_row(1.0, 0.0, lambdax, lx, U, fxp, fxm);
+
+      for(i0=ib; i0<ie+1; i0+=NB)
+      {
+         nf = PetscMin(NB, ie+1-i0);
+         for(d=0; d<nvar; ++d)
+         {
+            for(k=0; k<6; ++k)
+            {
+               fp[k][d] = fxp[d] + i0-3+k - (ib-sw);
+               fm[k][d] = fxm[d] + i0-3+k - (ib-sw);
+            }
+            ul[d] = &u[j][i0-1][d];
+            ur[d] = &u[j][i0][d];
+         }
+         weno_flux_batch(0, nf, fp, fm, ul, ur, flux);
+
+         for(l=0; l<nf; ++l)
+         {
+            i = i0 + l;
+            if(i > ib)
+               for(d=0; d<nvar; ++d) res[j][i-1][d] += idx * flux[d][l];
+            if(i < ie)
+               for(d=0; d<nvar; ++d) res[j][i][d]   -= idx * flux[d][l];
+         }
+      }
+   }
+
+   // y-split fluxes of the cells ib,...,ie-1 of six rows, used as a ring
+   // buffer: row r is kept in slot (r-jb+sw)%6.
+   for(r=0; r<6; ++r)
+      for(d=0; d<nvar; ++d)
+      {
+         fyp[r][d] = fy + ((2*r)*nvar + d)*n;
+         fym[r][d] = fy + ((2*r+1)*nvar + d)*n;
+      }
+   for(r=jb-sw; r<jb+2; ++r)
+   {
+      for(d=0; d<nvar; ++d) U[d] = &u[r][ib][d];
+      split_fluxes_row(0.0, 1.0, lambday, n, U, fyp[(r-jb+sw)%6],
+                       fym[(r-jb+sw)%6]);
+   }
+
+   // y fluxes: faces between j-1 and j, for i0,...,i0+nf-1
+   for(j=jb; j<je+1; ++j)
+   {
+      // rows j-3,...,j+1 are in the buffer, add row j+2
+      r = j + 2;
+      for(d=0; d<nvar; ++d) U[d] = &u[r][ib][d];
+      split_fluxes_row(0.0, 1.0, lambday, n, U, fyp[(r-jb+sw)%6],
+                       fym[(r-jb+sw)%6]);
+
+      for(i0=ib; i0<ie; i0+=NB)
+      {
+         nf = PetscMin(NB, ie-i0);
+         for(d=0; d<nvar; ++d)
+         {
+            for(k=0; k<6; ++k)
+            {
+               fp[k][d] = fyp[(j-3+k-jb+sw)%6][d] + i0-ib;
+               fm[k][d] = fym[(j-3+k-jb+sw)%6][d] + i0-ib;
+            }
+            ul[d] = &u[j-1][i0][d];
+            ur[d] = &u[j][i0][d];
+         }
+         weno_flux_batch(1, nf, fp, fm, ul, ur, flux);
+
+         for(l=0; l<nf; ++l)
+         {
+            i = i0 + l;
+            if(j > jb)
+               for(d=0; d<nvar; ++d) res[j-1][i][d] += idy * flux[d][l];
+            if(j < je)
+               for(d=0; d<nvar; ++d) res[j][i][d]   -= idy * flux[d][l];
+         }
+      }
+   }
+}
+
+// Split the block [ib,ie) x [jb,je) among the threads along its longer side.
+// Each thread updates only its own cells and has its own line buffers.
+// With ctx->tile_x or ctx->tile_y, the block is instead cut into tiles which
+// are done one after the other, and shared out to the threads dynamically.
+void fluxes_threads(AppCtx *ctx, PetscScalar ***u, PetscScalar ***res,
+                    const double lambdax, const double lambday,
+                    PetscInt ib, PetscInt ie, PetscInt jb, PetscInt je)
+{
+   if(ie <= ib || je <= jb) return;
+   if(ctx->tile_x > 0 || ctx->tile_y > 0)
+   {
+      const PetscInt tx = ctx->tile_x > 0 ? ctx->tile_x : ie-ib;
+      const PetscInt ty = ctx->tile_y > 0 ? ctx->tile_y : je-jb;
+      const PetscInt ntx = (ie-ib+tx-1)/tx, nty = (je-jb+ty-1)/ty;
+#pragma omp parallel
+      {
+         int t = 0;
+#if defined(_OPENMP)
+         t = omp_get_thread_num();
+#endif
+         double *fx = ctx->fx + t*ctx->lfx, *fy = ctx->fy + t*ctx->lfy;
+#pragma omp for schedule(dynamic)
+         for(PetscInt k=0; k<ntx*nty; ++k)
+         {
+            const PetscInt i0 = ib + (k%ntx)*tx, j0 = jb + (k/ntx)*ty;
+            fluxes_batched(fx, fy, u, res, lambdax, lambday,
+                           i0, PetscMin(i0+tx,ie), j0, PetscMin(j0+ty,je));
+         }
+      }
+      return;
+   }
+#pragma omp parallel
+   {
+      int      t = 0, nt = 1;
+      PetscInt b, e;
+#if defined(_OPENMP)
+      t  = omp_get_thread_num();
+      nt = omp_get_num_threads();
+#endif
+      double *fx = ctx->fx + t*ctx->lfx, *fy = ctx->fy + t*ctx->lfy;
+      if(ie-ib > je-jb)
+      {
+         thread_range(ib, ie-ib, t, nt, &b, &e);
+         fluxes_batched(fx, fy, u, res, lambdax, lambday, b, e, jb, je);
+      }
+      else
+      {
+         thread_range(jb, je-jb, t, nt, &b, &e);
+         fluxes_batched(fx, fy, u, res, lambdax, lambday, ib, ie, b, e);
+      }
+   }
+}
+
+// Set up the four sides for the owned part of the grid. For a steady farfield
+// boundary the ghost values are computed once here.
+PetscErrorCode setup_sides(DM da, AppCtx *ctx)
+{
+   PetscErrorCode ierr;
+   PetscInt       ibeg, jbeg, nlocx, nlocy, nx, ny, s, g, t, n;
+   Side           *side = ctx->side;
+   double         x, y;
+
+   ierr = DMDAGetInfo(da,0,&nx,&ny,0,0,0,0,0,0,0,0,0,0); CHKERRQ(ierr);
+   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+
+   side[0].type = BC_LEFT;   side[0].dir = 0; side[0].first = -1; side[0].step = -1;
+   side[1].type = BC_RIGHT;  side[1].dir = 0; side[1].first = nx; side[1].step =  1;
+   side[2].type = BC_BOTTOM; side[2].dir = 1; side[2].first = -1; side[2].step = -1;
+   side[3].type = BC_TOP;    side[3].dir = 1; side[3].first = ny; side[3].step =  1;
+   side[0].c0 = xmin - 0.5*dx; side[1].c0 = xmax + 0.5*dx;
+   side[2].c0 = ymin - 0.5*dy; side[3].c0 = ymax + 0.5*dy;
+   side[0].owned = (ibeg == 0)        ? PETSC_TRUE : PETSC_FALSE;
+   side[1].owned = (ibeg+nlocx == nx) ? PETSC_TRUE : PETSC_FALSE;
+   side[2].owned = (jbeg == 0)        ? PETSC_TRUE : PETSC_FALSE;
+   side[3].owned = (jbeg+nlocy == ny) ? PETSC_TRUE : PETSC_FALSE;
+
+   for(s=0; s<4; ++s)
+   {
+      side[s].t0 = side[s].dir == 0 ? jbeg : ibeg;
+      side[s].t1 = side[s].dir == 0 ? jbeg+nlocy : ibeg+nlocx;
+      side[s].cache = NULL;
+      if(!side[s].owned || side[s].type != farfield || !steady_bc) continue;
+
+      n = side[s].t1 - side[s].t0;
+      ierr = PetscMalloc1(sw*n*nvar, &side[s].cache); CHKERRQ(ierr);
+      for(g=0; g<sw; ++g)
+         for(t=side[s].t0; t<side[s].t1; ++t)
+         {
+            double *c = side[s].cache + (g*n + t-side[s].t0)*nvar;
+            if(side[s].dir == 0)
+            {
+               x = side[s].c0 + side[s].step*g*dx;
+               y = ymin + t*dy + 0.5*dy;
+            }
+            else
+            {
+               x = xmin + t*dx + 0.5*dx;
+               y = side[s].c0 + side[s].step*g*dy;
+            }
+            boundary_value(0.0, x, y, c);
+         }
+   }
+   return(0);
+}
+
+// Fill the sw ghost layers outside one side, for the owned cells along it
+PetscErrorCode fill_ghosts(const Side *s, PetscReal time, PetscScalar ***u)
+{
+   const int      m = s->dir + 1; // normal momentum component
+   const PetscInt n = s->t1 - s->t0;
+   PetscInt       g, t, d, ng, ni;
+   double         *ug, *ui, x, y;
+
+   if(!s->owned) return(0);
+
+   switch(s->type)
+   {
+      case periodic: // Nothing to do
+         break;
+
+      case wall: // reflect about the boundary, flip the normal velocity
+         for(g=0; g<sw; ++g)
+         {
+            ng = s->first + s->step*g;
+            ni = s->first - s->step*(g+1);
+            for(t=s->t0; t<s->t1; ++t)
+            {
+               ug = s->dir == 0 ? u[t][ng] : u[ng][t];
+               ui = s->dir == 0 ? u[t][ni] : u[ni][t];
+               for(d=0; d<nvar; ++d) ug[d] = ui[d];
+               ug[m] = -ui[m];
+            }
+         }
+         break;
+
+      case neumann: // copy the first cell inside
+         ni = s->first - s->step;
+         for(g=0; g<sw; ++g)
+         {
+            ng = s->first + s->step*g;
+            for(t=s->t0; t<s->t1; ++t)
+            {
+               ug = s->dir == 0 ? u[t][ng] : u[ng][t];
+               ui = s->dir == 0 ? u[t][ni] : u[ni][t];
+               for(d=0; d<nvar; ++d) ug[d] = ui[d];
+            }
+         }
+         break;
+
+      case farfield:
+         for(g=0; g<sw; ++g)
+         {
+            ng = s->first + s->step*g;
+            for(t=s->t0; t<s->t1; ++t)
+            {
+               ug = s->dir == 0 ? u[t][ng] : u[ng][t];
+               if(s->cache)
+               {
+                  ui = s->cache + (g*n + t-s->t0)*nvar;
+                  for(d=0; d<nvar; ++d) ug[d] = ui[d];
+               }
+               else if(s->dir == 0)
+               {
+                  x = s->c0 + s->step*g*dx;
+                  y = ymin + t*dy + 0.5*dy;
+                  boundary_value(time, x, y, ug);
+               }
+               else
+               {
+                  x = xmin + t*dx + 0.5*dx;
+                  y = s->c0 + s->step*g*dy;
+                  boundary_value(time, x, y, ug);
+               }
+            }
+         }
+         break;
+
+      default:
+         SETERRQ(PETSC_COMM_WORLD,1,"bc is not implemented");
+   }
+   return(0);
+}
+
+// The rhs function in du/dt = R(t,u)
+PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
+{
+   AppCtx*        ctx = (AppCtx*) ptr;
+   DM             da;
+   Vec            localU;
+   PetscScalar    ***u, ***ug;
+   PetscScalar    ***res;
+   PetscScalar    ***fxp;
+   PetscScalar    ***fxm;
+   PetscScalar    ***fyp;
+   PetscScalar    ***fym;
+   PetscInt       i, j, ibeg, jbeg, nlocx, nlocy, d;
+   PetscInt       ni0, ni1, nj0, nj1;
+   PetscReal      lambdax, lambday;
+   PetscBool      lagged;
+   PetscErrorCode ierr;
+
+   ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
+   ierr = DMGetLocalVector(da,&localU); CHKERRQ(ierr);
+   // Start the ghost exchange, and work on the owned cells while it is going on
+   ierr = DMGlobalToLocalBegin(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
+   ierr = DMDAVecGetArrayDOFRead(da, U, &ug); CHKERRQ(ierr);
+   ierr = DMDAVecGetArrayDOF(da, R, &res); CHKERRQ(ierr);
+
+   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+
+   // Interior cells [ni0,ni1) x [nj0,nj1) whose stencil has only owned cells.
+   // The remaining owned cells form four strips along the sides.
+   ni0 = ibeg + PetscMin(sw, nlocx); ni1 = PetscMax(ni0, ibeg+nlocx-sw);
+   nj0 = jbeg + PetscMin(sw, nlocy); nj1 = PetscMax(nj0, jbeg+nlocy-sw);
+
+   // ---Begin res computation---
+
+   // compute maximum wave speeds along x and y, and reduce both in one
+   // non-blocking call. With ctx->lag (the default), the split fluxes use the
+   // result of the previous reduction times ctx->safety, and this one
+   // completes during the residual evaluation, so the stage never waits for
+   // it. Without it, the split fluxes use the exact wave speeds of U and the
+   // reduction is waited for before the interior fluxes; only the zeroing of
+   // the residual by the scalar kernel overlaps with it.
+   if(ctx->req != MPI_REQUEST_NULL)
+   {
+      ierr = MPI_Wait(&ctx->req, MPI_STATUS_IGNORE); CHKERRQ(ierr);
+   }
+   max_speeds(ug, ibeg, jbeg, nlocx, nlocy, ctx->lamloc);
+   lagged  = ctx->lag && ctx->lam[0] > 0.0;
+   lambdax = ctx->safety * ctx->lam[0];
+   lambday = ctx->safety * ctx->lam[1];
+   ierr = MPI_Iallreduce(ctx->lamloc, ctx->lam, 2, MPI_DOUBLE, MPI_MAX,
+                         PETSC_COMM_WORLD, &ctx->req); CHKERRQ(ierr);
+
+   // set residual to zero; the batched kernel does this for each block
+   if(ctx->kernel == kernel_scalar)
+   {
+#pragma omp parallel for private(i,d)
+      for(j=jbeg; j<jbeg+nlocy; ++j)
+         for(i=ibeg; i<ibeg+nlocx; ++i)
+            for(d=0; d<nvar; ++d)
+               res[j][i][d] = 0;
+   }
+
+   if(!lagged)
+   {
+      ierr = MPI_Wait(&ctx->req, MPI_STATUS_IGNORE); CHKERRQ(ierr);
+      lambdax = ctx->lam[0];
+      lambday = ctx->lam[1];
+   }
+
+   // Interior cells need no ghost values
+   if(ctx->kernel == kernel_batched)
+   {
+      fluxes_threads(ctx, ug, res, lambdax, lambday, ni0, ni1, nj0, nj1);
+   }
+   ierr = DMDAVecRestoreArrayDOFRead(da, U, &ug); CHKERRQ(ierr);
+
+   // Finish the ghost exchange
+   ierr = DMGlobalToLocalEnd(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
+   ierr = DMDAVecGetArrayDOF(da, localU, &u); CHKERRQ(ierr);
+
+   // Fill in ghost values based on boundary condition
+   for(i=0; i<4; ++i)
+   {
+      ierr = fill_ghosts(&ctx->side[i], time, u); CHKERRQ(ierr);
+   }
+
+   // Boundary strips
+   if(ctx->kernel == kernel_batched)
+   {
+      fluxes_threads(ctx, u, res, lambdax, lambday, ibeg, ibeg+nlocx, jbeg, nj0);
+      fluxes_threads(ctx, u, res, lambdax, lambday, ibeg, ibeg+nlocx, nj1, jbeg+nlocy);
+      fluxes_threads(ctx, u, res, lambdax, lambday, ibeg, ni0, nj0, nj1);
+      fluxes_threads(ctx, u, res, lambdax, lambday, ni1, ibeg+nlocx, nj0, nj1);
+   }
+   else
+   {
+      ierr = DMDAVecGetArrayDOF(da, ctx->fxp, &fxp); CHKERRQ(ierr);
+      ierr = DMDAVecGetArrayDOF(da, ctx->fxm, &fxm); CHKERRQ(ierr);
+      ierr = DMDAVecGetArrayDOF(da, ctx->fyp, &fyp); CHKERRQ(ierr);
+      ierr = DMDAVecGetArrayDOF(da, ctx->fym, &fym); CHKERRQ(ierr);
+
+      // Compute x-split fluxes
+#pragma omp parallel for private(i)
+      for(j=jbeg; j<jbeg+nlocy; ++j)
+         for(i=ibeg-sw; i<ibeg+nlocx+sw; ++i)
+         {
+            split_fluxes(u[j][i], 1.0, 0.0, lambdax, fxp[j][i], fxm[j][i]);
+         }
+
+      // Compute y-split fluxes
+#pragma omp parallel for private(i)
+      for(j=jbeg-sw; j<jbeg+nlocy+sw; ++j)
+         for(i=ibeg; i<ibeg+nlocx; ++i)
+         {
+            split_fluxes(u[j][i], 0.0, 1.0, lambday, fyp[j][i], fym[j][i]);
+         }
+
+      fluxes_scalar(u, fxp, fxm, fyp, fym, res, ibeg, jbeg, nlocx, nlocy);
+
+      ierr = DMDAVecRestoreArrayDOF(da, ctx->fxp, &fxp); CHKERRQ(ierr);
+      ierr = DMDAVecRestoreArrayDOF(da, ctx->fxm, &fxm); CHKERRQ(ierr);
+      ierr = DMDAVecRestoreArrayDOF(da, ctx->fyp, &fyp); CHKERRQ(ierr);
+      ierr = DMDAVecRestoreArrayDOF(da, ctx->fym, &fym); CHKERRQ(ierr);
+   }
 
    // ---End res computation---
 
@@ -711,11 +1116,6 @@ PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
    ierr = DMDAVecRestoreArrayDOF(da, R, &res); CHKERRQ(ierr);
    ierr = DMRestoreLocalVector(da,&localU); CHKERRQ(ierr);
 
-   ierr = DMDAVecRestoreArrayDOF(da, ctx->fxp, &fxp); CHKERRQ(ierr);
-   ierr = DMDAVecRestoreArrayDOF(da, ctx->fxm, &fxm); CHKERRQ(ierr);
-   ierr = DMDAVecRestoreArrayDOF(da, ctx->fyp, &fyp); CHKERRQ(ierr);
-   ierr = DMDAVecRestoreArrayDOF(da, ctx->fym, &fym); CHKERRQ(ierr);
-
    PetscFunctionReturn(0);
 }
 
@@ -724,39 +1124,58 @@ PetscErrorCode Monitor(TS ts,PetscInt step,PetscReal time,Vec U,void *ptr)
 {
    AppCtx*        ctx = (AppCtx*) ptr;
    DM             da;
-   PetscInt       i, j, ibeg, jbeg, nlocx, nlocy;
-   PetscReal      dtlocal, dtglobal;
+   PetscInt       ibeg, jbeg, nlocx, nlocy;
+   PetscReal      dtglobal;
    PetscScalar    ***u;
+   PetscBool      final;
    PetscErrorCode ierr;
 
    if (step < 0) return(0); /* step of -1 indicates an interpolated solution */
 
    ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
+   final = (PetscAbs(time-ctx->Tf) < 1.0e-13) ? PETSC_TRUE : PETSC_FALSE;
 
-   if(step > 0 && (step%ctx->si == 0 || PetscAbs(time-ctx->Tf) < 1.0e-13))
+   // Start the reduction for the time step, together with the wave speeds
+   // which the next residual evaluation uses unless -lambda_lag 0.
+   if(ctx->cfl > 0 && !final)
    {
-      ierr = savesol(time, da, U); CHKERRQ(ierr);
+      if(ctx->req != MPI_REQUEST_NULL)
+      {
+         ierr = MPI_Wait(&ctx->req, MPI_STATUS_IGNORE); CHKERRQ(ierr);
+      }
+      ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+      ierr = DMDAVecGetArrayDOFRead(da, U, &u); CHKERRQ(ierr);
+      max_speeds(u, ibeg, jbeg, nlocx, nlocy, ctx->lamloc);
+      ierr = DMDAVecRestoreArrayDOFRead(da, U, &u); CHKERRQ(ierr);
+      ierr = MPI_Iallreduce(ctx->lamloc, ctx->lam, 3, MPI_DOUBLE, MPI_MAX,
+                            PETSC_COMM_WORLD, &ctx->req); CHKERRQ(ierr);
+   }
+
+   if(step > ctx->step0 && (step%ctx->si == 0 || final))
+   {
+      ierr = savesol(time, da, U, &ctx->out); CHKERRQ(ierr);
+   }
+
+   // Write checkpoints alternately into two files, so that one is complete
+   // even if the job stops while writing the other.
+   if(ctx->ci > 0 && step > ctx->step0 && step%ctx->ci == 0 && !final)
+   {
+      char      filename[32];
+      PetscReal dt;
+      sprintf(filename, "checkpoint-%d.dat", (int)((step/ctx->ci)%2));
+      ierr = TSGetTimeStep(ts, &dt); CHKERRQ(ierr);
+      ierr = write_checkpoint(filename, U, time, step, dt, ctx->out.c); CHKERRQ(ierr);
    }
 
    // If final time reached, dont do anything else, return from function.
-   if(PetscAbs(time-ctx->Tf) < 1.0e-13)
+   if(final)
       PetscFunctionReturn(0);
 
    // Compute time step based on cfl
    if(ctx->cfl > 0)
    {
-      ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
-      ierr = DMDAVecGetArrayDOFRead(da, U, &u); CHKERRQ(ierr);
-
-      dtlocal = 1.0e20;
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-         for(i=ibeg; i<ibeg+nlocx; ++i)
-         {
-            dtlocal = PetscMin(dtlocal, dt_local(u[j][i]));
-         }
-      ierr = DMDAVecRestoreArrayDOFRead(da, U, &u); CHKERRQ(ierr);
-      ierr = MPI_Allreduce(&dtlocal, &dtglobal, 1, MPI_DOUBLE, MPI_MIN,
-                           PETSC_COMM_WORLD);  CHKERRQ(ierr);
+      ierr = MPI_Wait(&ctx->req, MPI_STATUS_IGNORE); CHKERRQ(ierr);
+      dtglobal = 1.0/ctx->lam[2];
       dtglobal *= ctx->cfl;
       // Adjust dt to reach final time exactly
       if(time+dtglobal > ctx->Tf) dtglobal = ctx->Tf - time;
@@ -837,6 +1256,178 @@ PetscErrorCode compute_error(double t, DM da, Vec ug)
    return(0);
 }
 
+//------------------------------------------------------------------------------
+// Evaluate the residual nrep times with each kernel, report time per
+// evaluation and difference between the two residuals.
+//------------------------------------------------------------------------------
+PetscErrorCode check_kernels(TS ts, Vec ug, AppCtx *ctx, PetscInt nrep)
+{
+   PetscErrorCode ierr;
+   Kernel         kernel = ctx->kernel;
+   Vec            r0, r1;
+   PetscInt       n;
+   PetscLogDouble t0, t1, time[2];
+   PetscReal      rnorm, dnorm;
+
+   ierr = VecDuplicate(ug, &r0); CHKERRQ(ierr);
+   ierr = VecDuplicate(ug, &r1); CHKERRQ(ierr);
+
+   // With lagged wave speeds, one evaluation first, so that all those below
+   // use the same wave speeds
+   ierr = RHSFunction(ts, 0.0, ug, r0, ctx); CHKERRQ(ierr);
+
+   ctx->kernel = kernel_scalar;
+   ierr = PetscTime(&t0); CHKERRQ(ierr);
+   for(n=0; n<nrep; ++n)
+   {
+      ierr = RHSFunction(ts, 0.0, ug, r0, ctx); CHKERRQ(ierr);
+   }
+   ierr = PetscTime(&t1); CHKERRQ(ierr);
+   time[0] = (t1 - t0)/nrep;
+
+   ctx->kernel = kernel_batched;
+   ierr = PetscTime(&t0); CHKERRQ(ierr);
+   for(n=0; n<nrep; ++n)
+   {
+      ierr = RHSFunction(ts, 0.0, ug, r1, ctx); CHKERRQ(ierr);
+   }
+   ierr = PetscTime(&t1); CHKERRQ(ierr);
+   time[1] = (t1 - t0)/nrep;
+
+   ierr = VecNorm(r0, NORM_INFINITY, &rnorm); CHKERRQ(ierr);
+   ierr = VecAXPY(r1, -1.0, r0); CHKERRQ(ierr);
+   ierr = VecNorm(r1, NORM_INFINITY, &dnorm); CHKERRQ(ierr);
+
+   PetscPrintf(PETSC_COMM_WORLD,"Residual time: scalar = %e s, batched = %e s, speedup = %f\n",
+               time[0], time[1], time[0]/time[1]);
+   PetscPrintf(PETSC_COMM_WORLD,"Residual difference: max = %e, relative = %e\n",
+               dnorm, dnorm/PetscMax(rnorm, 1.0e-300));
+
+   ierr = VecDestroy(&r0); CHKERRQ(ierr);
+   ierr = VecDestroy(&r1); CHKERRQ(ierr);
+   ctx->kernel = kernel;
+   return(0);
+}
+
+//------------------------------------------------------------------------------
+// Model of the work in one residual evaluation with the batched kernel.
+// Floating point operations are counted from the code, with a division or
+// square root counted as one: per face in weno_flux_batch and the update of
+// res, per cell and direction in split_fluxes_row, and per cell in max_speeds.
+// Memory traffic counts the solution and residual moved to and from memory:
+// if the working set of a tile fits in a cache of the given size, each value
+// is moved once, otherwise the solution is read once by each of the two
+// sweeps and the residual is written by the x sweep and updated by the y sweep.
+//------------------------------------------------------------------------------
+#if defined(WENOJS)
+#define FLOPS_FACE  983
+#else
+#define FLOPS_FACE  1047
+#endif
+#define FLOPS_SPLIT 48
+#define FLOPS_SPEED 24
+
+// Add the work for the block [ib,ie) x [jb,je) cut into tiles as in
+// fluxes_threads; *ws is set to the largest working set of a tile in bytes.
+void block_work(AppCtx *ctx, PetscInt ib, PetscInt ie, PetscInt jb, PetscInt je,
+                double cache, double *flops, double *bytes, double *ws)
+{
+   const double   b = sizeof(double)*nvar;
+   const PetscInt tx = ctx->tile_x > 0 ? ctx->tile_x : ie-ib;
+   const PetscInt ty = ctx->tile_y > 0 ? ctx->tile_y : je-jb;
+   PetscInt       i0, j0;
+
+   if(ie <= ib || je <= jb) return;
+   for(j0=jb; j0<je; j0+=ty)
+      for(i0=ib; i0<ie; i0+=tx)
+      {
+         const double w = PetscMin(tx, ie-i0), h = PetscMin(ty, je-j0);
+         const double uread = (w+2*sw)*h + 2*sw*w; // cells with halo
+         // solution, residual and line buffers
+         const double wset = b*(uread + w*h) + 2*b*((w+2*sw) + 6*w);
+
+         *flops += FLOPS_FACE*((w+1)*h + w*(h+1))
+                 + FLOPS_SPLIT*((w+2*sw)*h + w*(h+2*sw));
+         if(wset <= cache)
+            *bytes += b*(uread + w*h);
+         else
+            *bytes += b*((w+2*sw)*h + w*(h+2*sw) + 3*w*h);
+         *ws = PetscMax(*ws, wset);
+      }
+}
+
+// Time nrep residual evaluations without and with the tiles given by
+// -tile_x, -tile_y, and report the modelled flops and bytes per evaluation.
+PetscErrorCode check_tiles(TS ts, Vec ug, AppCtx *ctx, PetscInt nrep,
+                           double cache)
+{
+   PetscErrorCode ierr;
+   Kernel         kernel = ctx->kernel;
+   DM             da;
+   Vec            r[2];
+   PetscInt       tile[2][2], ibeg, jbeg, nlocx, nlocy, n, c;
+   PetscInt       ni0, ni1, nj0, nj1;
+   PetscLogDouble t0, t1;
+   PetscReal      rnorm, dnorm;
+   double         work[3], sum[3], time;
+
+   ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
+   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+   ni0 = ibeg + PetscMin(sw, nlocx); ni1 = PetscMax(ni0, ibeg+nlocx-sw);
+   nj0 = jbeg + PetscMin(sw, nlocy); nj1 = PetscMax(nj0, jbeg+nlocy-sw);
+
+   ctx->kernel = kernel_batched;
+   ierr = VecDuplicate(ug, &r[0]); CHKERRQ(ierr);
+   ierr = VecDuplicate(ug, &r[1]); CHKERRQ(ierr);
+
+   // With lagged wave speeds, one evaluation first, so that all those below
+   // use the same wave speeds
+   ierr = RHSFunction(ts, 0.0, ug, r[0], ctx); CHKERRQ(ierr);
+
+   tile[0][0] = tile[0][1] = 0;
+   tile[1][0] = ctx->tile_x; tile[1][1] = ctx->tile_y;
+   for(c=0; c<2; ++c)
+   {
+      ctx->tile_x = tile[c][0]; ctx->tile_y = tile[c][1];
+      ierr = PetscTime(&t0); CHKERRQ(ierr);
+      for(n=0; n<nrep; ++n)
+      {
+         ierr = RHSFunction(ts, 0.0, ug, r[c], ctx); CHKERRQ(ierr);
+      }
+      ierr = PetscTime(&t1); CHKERRQ(ierr);
+      time = (t1 - t0)/nrep;
+
+      // Same blocks as in RHSFunction, and the wave speeds
+      work[0] = FLOPS_SPEED*nlocx*nlocy;
+      work[1] = sizeof(double)*nvar*nlocx*nlocy;
+      work[2] = 0.0;
+      block_work(ctx, ni0, ni1, nj0, nj1, cache, &work[0], &work[1], &work[2]);
+      block_work(ctx, ibeg, ibeg+nlocx, jbeg, nj0, cache, &work[0], &work[1], &work[2]);
+      block_work(ctx, ibeg, ibeg+nlocx, nj1, jbeg+nlocy, cache, &work[0], &work[1], &work[2]);
+      block_work(ctx, ibeg, ni0, nj0, nj1, cache, &work[0], &work[1], &work[2]);
+      block_work(ctx, ni1, ibeg+nlocx, nj0, nj1, cache, &work[0], &work[1], &work[2]);
+      ierr = MPI_Allreduce(work, sum, 2, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD); CHKERRQ(ierr);
+      ierr = MPI_Allreduce(&work[2], &sum[2], 1, MPI_DOUBLE, MPI_MAX, PETSC_COMM_WORLD); CHKERRQ(ierr);
+      ierr = MPI_Allreduce(MPI_IN_PLACE, &time, 1, MPI_DOUBLE, MPI_MAX, PETSC_COMM_WORLD); CHKERRQ(ierr);
+
+      PetscPrintf(PETSC_COMM_WORLD,"Tile %d x %d: time = %e s, tile working set = %g kB\n",
+                  tile[c][0], tile[c][1], time, sum[2]/1024.0);
+      PetscPrintf(PETSC_COMM_WORLD,"   flops = %e, bytes = %e, bytes/flop = %f, Gflop/s = %f, GB/s = %f\n",
+                  sum[0], sum[1], sum[1]/sum[0], 1.0e-9*sum[0]/time, 1.0e-9*sum[1]/time);
+   }
+
+   ierr = VecNorm(r[0], NORM_INFINITY, &rnorm); CHKERRQ(ierr);
+   ierr = VecAXPY(r[1], -1.0, r[0]); CHKERRQ(ierr);
+   ierr = VecNorm(r[1], NORM_INFINITY, &dnorm); CHKERRQ(ierr);
+   PetscPrintf(PETSC_COMM_WORLD,"Residual difference: max = %e, relative = %e\n",
+               dnorm, dnorm/PetscMax(rnorm, 1.0e-300));
+
+   ierr = VecDestroy(&r[0]); CHKERRQ(ierr);
+   ierr = VecDestroy(&r[1]); CHKERRQ(ierr);
+   ctx->kernel = kernel;
+   return(0);
+}
+
 //------------------------------------------------------------------------------
 int main(int argc, char *argv[])
 {
@@ -850,9 +1441,19 @@ int main(int argc, char *argv[])
    Vec         ug;
    PetscInt    i, j, ibeg, jbeg, nlocx, nlocy;
    PetscMPIInt rank, size;
+   PetscInt    nrep = 0, ntile = 0;
+   PetscReal   cache = 1024.0;
    PetscReal   dtglobal, dtlocal = 1.0e20;
+   PetscReal   t0 = 0.0;
+   char        chkfile[PETSC_MAX_PATH_LEN];
+   PetscBool   restart = PETSC_FALSE;
    PetscScalar ***u;
 
+#if defined(_OPENMP)
+   // Only the master thread makes MPI calls
+   int provided;
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#endif
    ierr = PetscInitialize(&argc, &argv, (char*)0, help); CHKERRQ(ierr);
 
    ctx.Tf  = final_time; // over-ride with command line option -Tf
@@ -860,6 +1461,20 @@ int main(int argc, char *argv[])
    ctx.cfl = -1.0;
    ctx.max_steps = 1000000;
    ctx.si = 100;
+   ctx.ci = 0;
+   ctx.step0 = 0;
+   OutputCreate(&ctx.out);
+   ctx.kernel = kernel_batched;
+   ctx.lag = PETSC_TRUE;
+   ctx.safety = 1.1;
+   ctx.lam[0] = ctx.lam[1] = ctx.lam[2] = 0.0;
+   ctx.req = MPI_REQUEST_NULL;
+   ctx.nthreads = 1;
+   ctx.tile_x = ctx.tile_y = 0;
+#if defined(_OPENMP)
+   ctx.nthreads = omp_get_max_threads();
+   PetscPrintf(PETSC_COMM_WORLD,"Number of threads per process = %d\n", ctx.nthreads);
+#endif
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
    MPI_Comm_size(PETSC_COMM_WORLD, &size);
@@ -869,6 +1484,19 @@ int main(int argc, char *argv[])
    ierr = PetscOptionsGetReal(NULL,NULL,"-dt",&ctx.dt,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetReal(NULL,NULL,"-cfl",&ctx.cfl,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetInt(NULL,NULL,"-si",&ctx.si,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-ci",&ctx.ci,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetString(NULL,NULL,"-restart",chkfile,sizeof(chkfile),&restart); CHKERRQ(ierr);
+   ierr = PetscOptionsGetEnum(NULL,NULL,"-sol_format",OutputFormats,(PetscEnum*)&ctx.out.format,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetBool(NULL,NULL,"-sol_single",&ctx.out.single,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetBool(NULL,NULL,"-sol_async",&ctx.out.async,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetEnum(NULL,NULL,"-kernel",Kernels,(PetscEnum*)&ctx.kernel,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-kernel_check",&nrep,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetBool(NULL,NULL,"-lambda_lag",&ctx.lag,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetReal(NULL,NULL,"-lambda_safety",&ctx.safety,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-tile_x",&ctx.tile_x,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-tile_y",&ctx.tile_y,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-tile_check",&ntile,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetReal(NULL,NULL,"-tile_cache",&cache,NULL); CHKERRQ(ierr);
 
    int PERIODIC_X = 0, PERIODIC_Y = 0;
    if(BC_LEFT == periodic && BC_RIGHT == periodic) ++PERIODIC_X;
@@ -914,13 +1542,25 @@ int main(int argc, char *argv[])
    ierr = DMCreateGlobalVector(da, &ug); CHKERRQ(ierr);
    ierr = PetscObjectSetName((PetscObject) ug, "Solution"); CHKERRQ(ierr);
 
-   // Create vectors to store split fluxes
-   ierr = DMCreateLocalVector(da, &ctx.fxp); CHKERRQ(ierr);
-   ierr = DMCreateLocalVector(da, &ctx.fxm); CHKERRQ(ierr);
-   ierr = DMCreateLocalVector(da, &ctx.fyp); CHKERRQ(ierr);
-   ierr = DMCreateLocalVector(da, &ctx.fym); CHKERRQ(ierr);
-
    ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+
+   // Line buffers for split fluxes, for each thread: one row with ghosts along
+   // x, six rows along y. The scalar kernel needs split fluxes on the whole
+   // grid.
+   ctx.lfx = 2*nvar*(nlocx+2*sw);
+   ctx.lfy = 6*2*nvar*nlocx;
+   ierr = PetscMalloc1(ctx.nthreads*ctx.lfx, &ctx.fx); CHKERRQ(ierr);
+   ierr = PetscMalloc1(ctx.nthreads*ctx.lfy, &ctx.fy); CHKERRQ(ierr);
+   ctx.fxp = ctx.fxm = ctx.fyp = ctx.fym = NULL;
+   if(ctx.kernel == kernel_scalar || nrep > 0)
+   {
+      ierr = DMCreateLocalVector(da, &ctx.fxp); CHKERRQ(ierr);
+      ierr = DMCreateLocalVector(da, &ctx.fxm); CHKERRQ(ierr);
+      ierr = DMCreateLocalVector(da, &ctx.fyp); CHKERRQ(ierr);
+      ierr = DMCreateLocalVector(da, &ctx.fym); CHKERRQ(ierr);
+   }
+   ierr = setup_sides(da, &ctx); CHKERRQ(ierr);
+
    ierr = DMDAVecGetArrayDOF(da, ug, &u); CHKERRQ(ierr);
    for(j=jbeg; j<jbeg+nlocy; ++j)
       for(i=ibeg; i<ibeg+nlocx; ++i)
@@ -952,14 +1592,23 @@ int main(int argc, char *argv[])
    }
    PetscPrintf(PETSC_COMM_WORLD,"Initial time step = %e\n", ctx.dt);
 
-   // Save initial condition to file
-   ierr = savesol(0.0, da, ug); CHKERRQ(ierr);
+   // Continue from a checkpoint, or save initial condition to file
+   if(restart)
+   {
+      ierr = read_checkpoint(chkfile, ug, &t0, &ctx.step0, &ctx.dt, &ctx.out.c); CHKERRQ(ierr);
+   }
+   else
+   {
+      ierr = savesol(0.0, da, ug, &ctx.out); CHKERRQ(ierr);
+   }
 
    ierr = TSCreate(PETSC_COMM_WORLD,&ts); CHKERRQ(ierr);
    ierr = TSSetDM(ts,da); CHKERRQ(ierr);
    ierr = TSSetProblemType(ts,TS_NONLINEAR); CHKERRQ(ierr);
    ierr = TSSetRHSFunction(ts,NULL,RHSFunction,&ctx); CHKERRQ(ierr);
    ierr = TSSetTimeStep(ts,ctx.dt);
+   ierr = TSSetTime(ts,t0); CHKERRQ(ierr);
+   ierr = TSSetStepNumber(ts,ctx.step0); CHKERRQ(ierr);
    ierr = TSSetType(ts,TSSSP); CHKERRQ(ierr);
    ierr = TSSetMaxSteps(ts,ctx.max_steps); CHKERRQ(ierr);
    ierr = TSSetMaxTime(ts,ctx.Tf); CHKERRQ(ierr);
@@ -969,7 +1618,21 @@ int main(int argc, char *argv[])
    ierr = TSSetFromOptions(ts); CHKERRQ(ierr);
    ierr = TSSetUp(ts); CHKERRQ(ierr);
 
+   if(nrep > 0)
+   {
+      ierr = check_kernels(ts, ug, &ctx, nrep); CHKERRQ(ierr);
+   }
+   if(ntile > 0)
+   {
+      ierr = check_tiles(ts, ug, &ctx, ntile, 1024.0*cache); CHKERRQ(ierr);
+   }
+
    ierr = TSSolve(ts,ug); CHKERRQ(ierr);
+   ierr = OutputFinish(&ctx.out); CHKERRQ(ierr);
+   if(ctx.req != MPI_REQUEST_NULL)
+   {
+      ierr = MPI_Wait(&ctx.req, MPI_STATUS_IGNORE); CHKERRQ(ierr);
+   }
 
    if(has_exact_sol)
    {
@@ -982,9 +1645,18 @@ int main(int argc, char *argv[])
    ierr = VecDestroy(&ctx.fxm); CHKERRQ(ierr);
    ierr = VecDestroy(&ctx.fyp); CHKERRQ(ierr);
    ierr = VecDestroy(&ctx.fym); CHKERRQ(ierr);
+   ierr = PetscFree(ctx.fx); CHKERRQ(ierr);
+   ierr = PetscFree(ctx.fy); CHKERRQ(ierr);
+   for(i=0; i<4; ++i)
+   {
+      ierr = PetscFree(ctx.side[i].cache); CHKERRQ(ierr);
+   }
 
    ierr = DMDestroy(&da); CHKERRQ(ierr);
    ierr = TSDestroy(&ts); CHKERRQ(ierr);
 
    ierr = PetscFinalize(); CHKERRQ(ierr);
+#if defined(_OPENMP)
+   MPI_Finalize();
+#endif
 }
@@ -0,0 +1,190 @@
+//------------------------------------------------------------------------------
+// Binary output of the solution, one file sol-NNN.vtk per output time written
+// by all processes together with MPI-IO. The file is in legacy VTK format,
+// which VisIt and ParaView read directly: a STRUCTURED_POINTS grid with nx x ny
+// cells carrying rho, u, v, p as cell data, in single or double precision.
+// Binary data in these files is big endian.
+// With write-behind (async), the collective write is only started here and is
+// completed at the next output or in OutputFinish, so the solver goes on while
+// the data is written.
+//------------------------------------------------------------------------------
+#include <stdint.h>
+
+typedef enum { output_plt, output_vtk } OutputFormat;
+const char *const OutputFormats[] = {"plt", "vtk", "OutputFormat", "output_", NULL};
+
+typedef struct
+{
+   OutputFormat format;
+   int          c;       // number of solution files written
+   PetscBool    single;  // write floats instead of doubles
+   PetscBool    async;   // write-behind
+   MPI_File     fh;      // file of a pending write
+   MPI_Request  req;     // pending write
+   void         *buf;    // owned cells of the pending write
+} Output;
+
+void con2prim(const double *Con, double *Prim);
+
+void OutputCreate(Output *out)
+{
+   out->format = output_vtk;
+   out->c      = 0;
+   out->single = PETSC_FALSE;
+   out->async  = PETSC_FALSE;
+   out->req    = MPI_REQUEST_NULL;
+   out->buf    = NULL;
+}
+
+// Complete a pending write and close its file
+PetscErrorCode OutputFinish(Output *out)
+{
+   PetscErrorCode ierr;
+
+   if(out->req == MPI_REQUEST_NULL) return(0);
+   ierr = MPI_Wait(&out->req, MPI_STATUS_IGNORE); CHKERRQ(ierr);
+   ierr = MPI_File_close(&out->fh); CHKERRQ(ierr);
+   ierr = PetscFree(out->buf); CHKERRQ(ierr);
+   return(0);
+}
+
+// Copy n bytes of src to dst in big endian order
+static inline void copy_be(void *dst, const void *src, int n)
+{
+   const uint16_t one = 1;
+   const unsigned char *s = (const unsigned char*)src;
+   unsigned char *d = (unsigned char*)dst;
+   if(*(const unsigned char*)&one)
+      for(int k=0; k<n; ++k) d[k] = s[n-1-k];
+   else
+      for(int k=0; k<n; ++k) d[k] = s[k];
+}
+
+// Append n bytes to the header h of length *len
+static inline void append(char *h, size_t *len, const void *data, size_t n)
+{
+   memcpy(h + *len, data, n);
+   *len += n;
+}
+
+PetscErrorCode savevtk(Output *out, int c, double t, DM da, Vec ug)
+{
+   PetscErrorCode ierr;
+   const char     *name[nvar] = {"rho", "u", "v", "p"};
+   const int      size = out->single ? sizeof(float) : sizeof(double);
+   MPI_Datatype   type = out->single ? MPI_FLOAT : MPI_DOUBLE;
+   MPI_Datatype   sub, ftype;
+   MPI_Aint       disp[nvar];
+   MPI_Offset     off[nvar+1], pos;
+   PetscMPIInt    rank;
+   PetscInt       i, j, d, nx, ny, ibeg, jbeg, nlocx, nlocy, n;
+   PetscScalar    ***u;
+   char           filename[32], line[512], h[nvar][1024];
+   size_t         len[nvar+1];
+   int            gsize[2], lsize[2], start[2];
+
+   // Complete the previous write, if it is still going on
+   ierr = OutputFinish(out); CHKERRQ(ierr);
+
+   MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
+   ierr = DMDAGetInfo(da,0,&nx,&ny,0,0,0,0,0,0,0,0,0,0); CHKERRQ(ierr);
+   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+   n = nlocx*nlocy;
+
+   // Primitive variables of the owned cells, one block per variable
+   ierr = PetscMalloc(nvar*n*size, &out->buf); CHKERRQ(ierr);
+   ierr = DMDAVecGetArrayDOFRead(da, ug, &u); CHKERRQ(ierr);
+   for(j=jbeg; j<jbeg+nlocy; ++j)
+      for(i=ibeg; i<ibeg+nlocx; ++i)
+      {
+         const PetscInt k = (j-jbeg)*nlocx + (i-ibeg);
+         double prim[nvar];
+         con2prim(u[j][i], prim);
+         for(d=0; d<nvar; ++d)
+         {
+            char *b = (char*)out->buf + (d*n + k)*size;
+            if(out->single)
+            {
+               const float v = prim[d];
+               copy_be(b, &v, sizeof v);
+            }
+            else
+               copy_be(b, &prim[d], sizeof prim[d]);
+         }
+      }
+   ierr = DMDAVecRestoreArrayDOFRead(da, ug, &u); CHKERRQ(ierr);
+
+   // Text before each variable, and the newline after the last one. The first
+   // one also has the grid, the time and the output number.
+   for(d=0; d<=nvar; ++d) len[d] = 0;
+   sprintf(line, "# vtk DataFile Version 3.0\n2d Euler solution\nBINARY\n"
+           "DATASET STRUCTURED_POINTS\nDIMENSIONS %d %d 1\n"
+           "ORIGIN %.17g %.17g 0\nSPACING %.17g %.17g 1\n"
+           "FIELD FieldData 2\nTIME 1 1 double\n",
+           (int)nx+1, (int)ny+1, xmin, ymin, dx, dy);
+   append(h[0], &len[0], line, strlen(line));
+   copy_be(line, &t, sizeof(double));
+   append(h[0], &len[0], line, sizeof(double));
+   sprintf(line, "\nCYCLE 1 1 int\n");
+   append(h[0], &len[0], line, strlen(line));
+   copy_be(line, &c, sizeof(int));
+   append(h[0], &len[0], line, sizeof(int));
+   sprintf(line, "\nCELL_DATA %d\n", (int)(nx*ny));
+   append(h[0], &len[0], line, strlen(line));
+   for(d=0; d<nvar; ++d)
+   {
+      sprintf(line, "%sSCALARS %s %s 1\nLOOKUP_TABLE default\n",
+              d > 0 ? "\n" : "", name[d], out->single ? "float" : "double");
+      append(h[d], &len[d], line, strlen(line));
+   }
+
+   // Offset of each variable in the file
+   pos = 0;
+   for(d=0; d<nvar; ++d)
+   {
+      off[d] = pos + len[d];
+      pos = off[d] + (MPI_Offset)nx*ny*size;
+   }
+   off[nvar] = pos;
+
+   sprintf(filename, "sol-%03d.vtk", c);
+   ierr = MPI_File_open(PETSC_COMM_WORLD, filename,
+                        MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                        &out->fh); CHKERRQ(ierr);
+   ierr = MPI_File_set_size(out->fh, 0); CHKERRQ(ierr);
+   if(rank == 0)
+   {
+      for(d=0; d<nvar; ++d)
+      {
+         ierr = MPI_File_write_at(out->fh, off[d]-len[d], h[d], len[d], MPI_CHAR,
+                                  MPI_STATUS_IGNORE); CHKERRQ(ierr);
+      }
+      ierr = MPI_File_write_at(out->fh, off[nvar], "\n", 1, MPI_CHAR,
+                               MPI_STATUS_IGNORE); CHKERRQ(ierr);
+   }
+
+   // Each process sees its part of the nvar arrays
+   gsize[0] = ny;    gsize[1] = nx;
+   lsize[0] = nlocy; lsize[1] = nlocx;
+   start[0] = jbeg;  start[1] = ibeg;
+   ierr = MPI_Type_create_subarray(2, gsize, lsize, start, MPI_ORDER_C, type,
+                                   &sub); CHKERRQ(ierr);
+   for(d=0; d<nvar; ++d) disp[d] = off[d];
+   ierr = MPI_Type_create_hindexed_block(nvar, 1, disp, sub, &ftype); CHKERRQ(ierr);
+   ierr = MPI_Type_commit(&ftype); CHKERRQ(ierr);
+   ierr = MPI_File_set_view(out->fh, 0, type, ftype, "native", MPI_INFO_NULL); CHKERRQ(ierr);
+   ierr = MPI_Type_free(&ftype); CHKERRQ(ierr);
+   ierr = MPI_Type_free(&sub); CHKERRQ(ierr);
+
+   if(out->async)
+   {
+      ierr = MPI_File_iwrite_all(out->fh, out->buf, nvar*n, type, &out->req); CHKERRQ(ierr);
+   }
+   else
+   {
+      ierr = MPI_File_write_all(out->fh, out->buf, nvar*n, type, MPI_STATUS_IGNORE); CHKERRQ(ierr);
+      ierr = MPI_File_close(&out->fh); CHKERRQ(ierr);
+      ierr = PetscFree(out->buf); CHKERRQ(ierr);
+   }
+   return(0);
+}
@@ -4,6 +4,9 @@ static char help[] = "Solves 2d Euler equations.\n\n";
 #include <petscdm.h>
 #include <petscdmda.h>
 #include <petscvec.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #define min(a,b)  ( (a < b) ? a : b )
 #define nvar  4
@@ -15,6 +18,8 @@ const double gas_gamma = 1.4;
 const double gas_const = 1.0;
 double dx, dy;
 
+#include "checkpoint.h"
+
 // Isentropic vortex
 void initcond(const double x, const double y, double *Prim)
 {
@@ -173,6 +178,117 @@ PetscErrorCode savesol(int *c, double t, DM da, Vec ug)
    ++(*c);
    return(0);
 }
+//------------------------------------------------------------------------------
+// Add flux differences to res for the cells [ib,ie) x [jb,je), counted from
+// the owned corner (ibeg,jbeg). Each cell is updated by its own faces in a
+// fixed order, so the result does not depend on how the owned cells are split
+// into blocks.
+//------------------------------------------------------------------------------
+void fluxes(PetscScalar ***u, PetscInt ibeg, PetscInt jbeg, PetscInt nlocx,
+            double (*res)[nlocx][nvar], PetscInt ib, PetscInt ie, PetscInt jb, PetscInt je)
+{
+   PetscInt i, j, d;
+
+   if(ie <= ib || je <= jb) return;
+
+   // x fluxes
+   for(i=ib; i<ie+1; ++i)
+      for(j=jb; j<je; ++j)
+      {
+         // face between k-1, k
+         int k = ibeg+i;
+         int l = jbeg+j;
+         double UL[nvar], UR[nvar], flux[nvar];
+         for(d=0; d<nvar; ++d)
+         {
+            UL[d] = weno5(u[l][k-3][d],u[l][k-2][d],u[l][k-1][d],u[l][k][d],u[l][k+1][d]);
+            UR[d] = weno5(u[l][k+2][d],u[l][k+1][d],u[l][k][d],u[l][k-1][d],u[l][k-2][d]);
+         }
+         numflux(UL, UR, 1.0, 0.0, flux);
+         if(i==ib)
+         {
+            for(d=0; d<nvar; ++d)
+               res[j][i][d] -= dy * flux[d];
+         }
+         else if(i==ie)
+         {
+            for(d=0; d<nvar; ++d)
+               res[j][i-1][d] += dy * flux[d];
+         }
+         else
+         {
+            for(d=0; d<nvar; ++d)
+            {
+               res[j][i][d]   -= dy * flux[d];
+               res[j][i-1][d] += dy * flux[d];
+            }
+         }
+      }
+
+   // y fluxes
+   for(j=jb; j<je+1; ++j)
+      for(i=ib; i<ie; ++i)
+      {
+         // face between l-1, l
+         int k = ibeg+i;
+         int l = jbeg+j;
+         double UL[nvar], UR[nvar], flux[nvar];
+         for(d=0; d<nvar; ++d)
+         {
+            UL[d] = weno5(u[l-3][k][d],u[l-2][k][d],u[l-1][k][d],u[l][k][d],u[l+1][k][d]);
+            UR[d] = weno5(u[l+2][k][d],u[l+1][k][d],u[l][k][d],u[l-1][k][d],u[l-2][k][d]);
+         }
+         numflux(UL, UR, 0.0, 1.0, flux);
+         if(j==jb)
+         {
+            for(d=0; d<nvar; ++d)
+               res[j][i][d] -= dx * flux[d];
+         }
+         else if(j==je)
+         {
+            for(d=0; d<nvar; ++d)
+               res[j-1][i][d] += dx * flux[d];
+         }
+         else
+         {
+            for(d=0; d<nvar; ++d)
+            {
+               res[j][i][d]   -= dx * flux[d];
+               res[j-1][i][d] += dx * flux[d];
+            }
+         }
+      }
+}
+
+// Split the block [ib,ie) x [jb,je) among the threads along its longer side.
+// Each thread updates only its own cells.
+void fluxes_threads(PetscScalar ***u, PetscInt ibeg, PetscInt jbeg, PetscInt nlocx,
+                    double (*res)[nlocx][nvar], PetscInt ib, PetscInt ie, PetscInt jb, PetscInt je)
+{
+   if(ie <= ib || je <= jb) return;
+#pragma omp parallel
+   {
+      int      t = 0, nt = 1;
+      PetscInt n, b, e;
+#if defined(_OPENMP)
+      t  = omp_get_thread_num();
+      nt = omp_get_num_threads();
+#endif
+      if(ie-ib > je-jb)
+      {
+         n = ie - ib;
+         b = ib + (n*t)/nt; e = ib + (n*(t+1))/nt;
+         fluxes(u, ibeg, jbeg, nlocx, res, b, e, jb, je);
+      }
+      else
+      {
+         n = je - jb;
+         b = jb + (n*t)/nt; e = jb + (n*(t+1))/nt;
+         fluxes(u, ibeg, jbeg, nlocx, res, ib, ie, b, e);
+      }
+   }
+}
+
 //------------------------------------------------------------------------------
 int main(int argc, char *argv[])
 {
@@ -180,6 +296,7 @@ int main(int argc, char *argv[])
    PetscReal Tf  = 10.0;
    PetscReal cfl = 0.8;
    PetscInt  si  = 100;
+   PetscInt  ci  = 0;   // checkpoint interval, 0 for no checkpoints
    PetscInt  nx  = 50, ny=50; // use -da_grid_x, -da_grid_y to override these
    
    PetscErrorCode ierr;
@@ -191,8 +308,18 @@ int main(int argc, char *argv[])
    PetscScalar ***u;
    PetscScalar ***unew;
    int c = 0; // counter for saving solution files
-
+   char      chkfile[PETSC_MAX_PATH_LEN];
+   PetscBool restart = PETSC_FALSE;
+
+#if defined(_OPENMP)
+   // Only the master thread makes MPI calls
+   int provided;
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#endif
    ierr = PetscInitialize(&argc, &argv, (char*)0, help); CHKERRQ(ierr);
+#if defined(_OPENMP)
+   PetscPrintf(PETSC_COMM_WORLD,"Number of threads per process = %d\n", omp_get_max_threads());
+#endif
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
    MPI_Comm_size(PETSC_COMM_WORLD, &size);
@@ -201,6 +328,8 @@ int main(int argc, char *argv[])
    ierr = PetscOptionsGetReal(NULL,NULL,"-Tf",&Tf,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetReal(NULL,NULL,"-cfl",&cfl,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetInt(NULL,NULL,"-si",&si,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-ci",&ci,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetString(NULL,NULL,"-restart",chkfile,sizeof(chkfile),&restart); CHKERRQ(ierr);
 
    ierr = DMDACreate2d(PETSC_COMM_WORLD, DM_BOUNDARY_PERIODIC, DM_BOUNDARY_PERIODIC,
                        DMDA_STENCIL_BOX, nx, ny, PETSC_DECIDE, PETSC_DECIDE, nvar,
@@ -228,7 +357,21 @@ int main(int argc, char *argv[])
          prim2con(prim, u[j][i]);
       }
    ierr = DMDAVecRestoreArrayDOF(da, ug, &u); CHKERRQ(ierr);
-   ierr = savesol(&c, 0.0, da, ug); CHKERRQ(ierr);
+
+   double dt = 0.0, lam;
+
+   double t = 0.0;
+   PetscInt it = 0;
+
+   // Continue from a checkpoint, or save initial condition to file
+   if(restart)
+   {
+      ierr = read_checkpoint(chkfile, ug, &t, &it, &dt, &c); CHKERRQ(ierr);
+   }
+   else
+   {
+      ierr = savesol(&c, 0.0, da, ug); CHKERRQ(ierr);
+   }
 
    // Get local view
    ierr = DMGetLocalVector(da, &ul); CHKERRQ(ierr);
@@ -240,10 +383,11 @@ int main(int argc, char *argv[])
    double (*res) [nlocx][nvar] = calloc(nlocy, sizeof(*res) );
    double (*uold)[nlocx][nvar] = calloc(nlocy, sizeof(*uold));
 
-   double dt, lam;
-
-   double t = 0.0;
-   int it = 0;
+   // Interior cells [ni0,ni1) x [nj0,nj1), counted from (ibeg,jbeg), whose
+   // stencil has only owned cells. The remaining owned cells form four strips
+   // along the sides, which are done after the ghost values arrive.
+   PetscInt ni0 = PetscMin(sw, nlocx), ni1 = PetscMax(ni0, nlocx-sw);
+   PetscInt nj0 = PetscMin(sw, nlocy), nj1 = PetscMax(nj0, nlocy-sw);
 
    while(t < Tf)
    {
@@ -258,6 +402,7 @@ int main(int argc, char *argv[])
             // compute time step
             double dtlocal = 1.0e20;
 
+#pragma omp parallel for private(i,d) reduction(min:dtlocal)
             for(j=jbeg; j<jbeg+nlocy; ++j)
                for(i=ibeg; i<ibeg+nlocx; ++i)
                {
@@ -273,84 +418,27 @@ int main(int argc, char *argv[])
             lam = dt/(dx*dy);
          }
 
+#pragma omp parallel for private(i,d)
          for(j=0; j<nlocy; ++j)
             for(i=0; i<nlocx; ++i)
                for(d=0; d<nvar; ++d)
                   res[j][i][d] = 0.0;
 
+         // Interior cells need no ghost values, use the owned values in ug
+         fluxes_threads(unew, ibeg, jbeg, nlocx, res, ni0, ni1, nj0, nj1);
+
          // finish global to local
          ierr = DMGlobalToLocalEnd(da, ug, INSERT_VALUES, ul); CHKERRQ(ierr);
          ierr = DMDAVecGetArrayDOFRead(da, ul, &u); CHKERRQ(ierr);
 
-         // x fluxes
-         for(i=0; i<nlocx+1; ++i)
-            for(j=0; j<nlocy; ++j)
-            {
-               // face between k-1, k
-               int k = il+sw+i;
-               int l = jl+sw+j;
-               double UL[nvar], UR[nvar], flux[nvar];
-               for(d=0; d<nvar; ++d)
-               {
-                  UL[d] = weno5(u[l][k-3][d],u[l][k-2][d],u[l][k-1][d],u[l][k][d],u[l][k+1][d]);
-                  UR[d] = weno5(u[l][k+2][d],u[l][k+1][d],u[l][k][d],u[l][k-1][d],u[l][k-2][d]);
-               }
-               numflux(UL, UR, 1.0, 0.0, flux);
-               if(i==0)
-               {
-                  for(d=0; d<nvar; ++d)
-                     res[j][i][d] -= dy * flux[d];
-               }
-               else if(i==nlocx)
-               {
-                  for(d=0; d<nvar; ++d)
-                     res[j][i-1][d] += dy * flux[d];
-               }
-               else
-               {
-                  for(d=0; d<nvar; ++d)
-                  {
-                     res[j][i][d]   -= dy * flux[d];
-                     res[j][i-1][d] += dy * flux[d];
-                  }
-               }
-            }
-
-         // y fluxes
-         for(j=0; j<nlocy+1; ++j)
-            for(i=0; i<nlocx; ++i)
-            {
-               // face between l-1, l
-               int k = il+sw+i;
-               int l = jl+sw+j;
-               double UL[nvar], UR[nvar], flux[nvar];
-               for(d=0; d<nvar; ++d)
-               {
-                  UL[d] = weno5(u[l-3][k][d],u[l-2][k][d],u[l-1][k][d],u[l][k][d],u[l+1][k][d]);
-                  UR[d] = weno5(u[l+2][k][d],u[l+1][k][d],u[l][k][d],u[l-1][k][d],u[l-2][k][d]);
-               }
-               numflux(UL, UR, 0.0, 1.0, flux);
-               if(j==0)
-               {
-                  for(d=0; d<nvar; ++d)
-                     res[j][i][d] -= dx * flux[d];
-               }
-               else if(j==nlocy)
-               {
-                  for(d=0; d<nvar; ++d)
-                     res[j-1][i][d] += dx * flux[d];
-               }
-               else
-               {
-                  for(d=0; d<nvar; ++d)
-                  {
-                     res[j][i][d]   -= dx * flux[d];
-                     res[j-1][i][d] += dx * flux[d];
-                  }
-               }
-            }
+         // Boundary strips
+         fluxes_threads(u, ibeg, jbeg, nlocx, res, 0, nlocx, 0, nj0);
+         fluxes_threads(u, ibeg, jbeg, nlocx, res, 0, nlocx, nj1, nlocy);
+         fluxes_threads(u, ibeg, jbeg, nlocx, res, 0, ni0, nj0, nj1);
+         fluxes_threads(u, ibeg, jbeg, nlocx, res, ni1, nlocx, nj0, nj1);
 
          // Update solution
+#pragma omp parallel for private(i,d)
          for(j=jbeg; j<jbeg+nlocy; ++j)
             for(i=ibeg; i<ibeg+nlocx; ++i)
                for(d=0; d<nvar; ++d)
@@ -367,6 +455,13 @@ int main(int argc, char *argv[])
       {
          ierr = savesol(&c, t, da, ug); CHKERRQ(ierr);
       }
+      // Alternate between two files, so that one is always complete
+      if(ci > 0 && it%ci == 0 && t < Tf)
+      {
+         char filename[32];
+         sprintf(filename, "checkpoint-%d.dat", (int)((it/ci)%2));
+         ierr = write_checkpoint(filename, ug, t, it, dt, c); CHKERRQ(ierr);
+      }
    }
 
    // Destroy everything before finishing
@@ -377,4 +472,7 @@ int main(int argc, char *argv[])
    free(res); free(uold);
 
    ierr = PetscFinalize(); CHKERRQ(ierr);
+#if defined(_OPENMP)
+   MPI_Finalize();
+#endif
 }
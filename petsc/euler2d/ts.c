@@ -3,6 +3,9 @@ static char help[] = "Solves 2d Euler equations.\n\n";
 #include <petscdm.h>
 #include <petscdmda.h>
 #include <petscts.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #define min(a,b)  ( (a < b) ? a : b )
 #define nvar  4
@@ -14,10 +17,18 @@ const double gas_gamma = 1.4;
 const double gas_const = 1.0;
 double dx, dy;
 
+#include "savevtk.h"
+#include "checkpoint.h"
+
 typedef struct
 {
    PetscReal dt, cfl, Tf;
    PetscInt  max_steps, si;
+   PetscInt  ci, step0; // checkpoint interval, first time step
+   PetscReal *UL, *UR; // reconstructed states along one row of faces
+   PetscInt  lu;       // length of UL, UR of each thread
+   int       nthreads;
+   Output    out;
 } AppCtx;
 
 extern PetscErrorCode RHSFunction(TS,PetscReal,Vec,Vec,void*);
@@ -40,7 +51,7 @@ void initcond(const double x, const double y, double *Prim)
 // Weno reconstruction
 // Return left value for face between u0, up1
 //------------------------------------------------------------------------------
-double weno5(const double um2, const double um1, const double u0, const double up1, const double up2)
+static inline double weno5(const double um2, const double um1, const double u0, const double up1, const double up2)
 {
    double eps = 1.0e-6;
    double gamma1=1.0/10.0, gamma2=3.0/5.0, gamma3=3.0/10.0;
@@ -138,7 +149,7 @@ void numflux(const double *Ul, const double *Ur, const double nx, const double n
 }
 
 //------------------------------------------------------------------------------
-PetscErrorCode savesol(double t, DM da, Vec ug)
+PetscErrorCode savesol(double t, DM da, Vec ug, Output *out)
 {
    PetscErrorCode ierr;
    char           filename[32] = "sol";
@@ -147,7 +158,13 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    FILE           *fp;
    Vec            ul;
    PetscScalar    ***u;
-   static int     c = 0;
+
+   if(out->format == output_vtk)
+   {
+      ierr = savevtk(out, out->c, t, da, ug); CHKERRQ(ierr);
+      ++out->c;
+      return(0);
+   }
 
    ierr = DMGetLocalVector(da, &ul); CHKERRQ(ierr);
    ierr = DMGlobalToLocalBegin(da, ug, INSERT_VALUES, ul); CHKERRQ(ierr);
@@ -160,7 +177,7 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    int jend = PetscMin(jbeg+nlocy+1, ny);
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
-   sprintf(filename, "sol-%03d-%03d.plt", c, rank);
+   sprintf(filename, "sol-%03d-%03d.plt", out->c, rank);
    fp = fopen(filename,"w");
    fprintf(fp, "TITLE = \"u_t + u_x + u_y = 0\"\n");
    fprintf(fp, "VARIABLES = x, y, rho, u, v, p\n");
@@ -179,7 +196,7 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    ierr = DMDAVecRestoreArrayDOFRead(da, ul, &u); CHKERRQ(ierr);
    ierr = DMRestoreLocalVector(da, &ul); CHKERRQ(ierr);
 
-   ++c;
+   ++out->c;
    return(0);
 }
 //------------------------------------------------------------------------------
@@ -196,8 +213,16 @@ int main(int argc, char *argv[])
    PetscInt    i, j, ibeg, jbeg, nlocx, nlocy;
    PetscMPIInt rank, size;
    PetscReal   dtglobal, dtlocal = 1.0e20;
+   PetscReal   t0 = 0.0;
+   char        chkfile[PETSC_MAX_PATH_LEN];
+   PetscBool   restart = PETSC_FALSE;
    PetscScalar ***u;
 
+#if defined(_OPENMP)
+   // Only the master thread makes MPI calls
+   int provided;
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#endif
    ierr = PetscInitialize(&argc, &argv, (char*)0, help); CHKERRQ(ierr);
 
    ctx.Tf  = 10.0;
@@ -205,6 +230,14 @@ int main(int argc, char *argv[])
    ctx.cfl = -1.0;
    ctx.max_steps = 1000000;
    ctx.si = 100;
+   ctx.ci = 0;
+   ctx.step0 = 0;
+   OutputCreate(&ctx.out);
+   ctx.nthreads = 1;
+#if defined(_OPENMP)
+   ctx.nthreads = omp_get_max_threads();
+   PetscPrintf(PETSC_COMM_WORLD,"Number of threads per process = %d\n", ctx.nthreads);
+#endif
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
    MPI_Comm_size(PETSC_COMM_WORLD, &size);
@@ -214,6 +247,11 @@ int main(int argc, char *argv[])
    ierr = PetscOptionsGetReal(NULL,NULL,"-dt",&ctx.dt,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetReal(NULL,NULL,"-cfl",&ctx.cfl,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetInt(NULL,NULL,"-si",&ctx.si,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-ci",&ctx.ci,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetString(NULL,NULL,"-restart",chkfile,sizeof(chkfile),&restart); CHKERRQ(ierr);
+   ierr = PetscOptionsGetEnum(NULL,NULL,"-sol_format",OutputFormats,(PetscEnum*)&ctx.out.format,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetBool(NULL,NULL,"-sol_single",&ctx.out.single,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetBool(NULL,NULL,"-sol_async",&ctx.out.async,NULL); CHKERRQ(ierr);
 
    ierr = DMDACreate2d(PETSC_COMM_WORLD, DM_BOUNDARY_PERIODIC, DM_BOUNDARY_PERIODIC,
                        DMDA_STENCIL_BOX, nx, ny, PETSC_DECIDE, PETSC_DECIDE, nvar,
@@ -230,6 +268,10 @@ int main(int argc, char *argv[])
    ierr = PetscObjectSetName((PetscObject) ug, "Solution"); CHKERRQ(ierr);
 
    ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+   ctx.lu = nvar*(nlocx+1);
+   ierr = PetscMalloc1(ctx.nthreads*ctx.lu, &ctx.UL); CHKERRQ(ierr);
+   ierr = PetscMalloc1(ctx.nthreads*ctx.lu, &ctx.UR); CHKERRQ(ierr);
+
    ierr = DMDAVecGetArrayDOF(da, ug, &u); CHKERRQ(ierr);
    for(j=jbeg; j<jbeg+nlocy; ++j)
       for(i=ibeg; i<ibeg+nlocx; ++i)
@@ -260,14 +302,23 @@ int main(int argc, char *argv[])
    }
    PetscPrintf(PETSC_COMM_WORLD,"Initial time step = %e\n", ctx.dt);
 
-   // Save initial condition to file
-   ierr = savesol(0.0, da, ug); CHKERRQ(ierr);
+   // Continue from a checkpoint, or save initial condition to file
+   if(restart)
+   {
+      ierr = read_checkpoint(chkfile, ug, &t0, &ctx.step0, &ctx.dt, &ctx.out.c); CHKERRQ(ierr);
+   }
+   else
+   {
+      ierr = savesol(0.0, da, ug, &ctx.out); CHKERRQ(ierr);
+   }
 
    ierr = TSCreate(PETSC_COMM_WORLD,&ts); CHKERRQ(ierr);
    ierr = TSSetDM(ts,da); CHKERRQ(ierr);
    ierr = TSSetProblemType(ts,TS_NONLINEAR); CHKERRQ(ierr);
    ierr = TSSetRHSFunction(ts,NULL,RHSFunction,&ctx); CHKERRQ(ierr);
    ierr = TSSetTimeStep(ts,ctx.dt);
+   ierr = TSSetTime(ts,t0); CHKERRQ(ierr);
+   ierr = TSSetStepNumber(ts,ctx.step0); CHKERRQ(ierr);
    ierr = TSSetType(ts,TSSSP); CHKERRQ(ierr);
    ierr = TSSetMaxSteps(ts,ctx.max_steps); CHKERRQ(ierr);
    ierr = TSSetMaxTime(ts,ctx.Tf); CHKERRQ(ierr);
@@ -278,60 +329,65 @@ int main(int argc, char *argv[])
    ierr = TSSetUp(ts); CHKERRQ(ierr);
 
    ierr = TSSolve(ts,ug); CHKERRQ(ierr);
+   ierr = OutputFinish(&ctx.out); CHKERRQ(ierr);
 
    // Destroy everything before finishing
    ierr = VecDestroy(&ug); CHKERRQ(ierr);
+   ierr = PetscFree(ctx.UL); CHKERRQ(ierr);
+   ierr = PetscFree(ctx.UR); CHKERRQ(ierr);
    ierr = DMDestroy(&da); CHKERRQ(ierr);
    ierr = TSDestroy(&ts); CHKERRQ(ierr);
 
    ierr = PetscFinalize(); CHKERRQ(ierr);
+#if defined(_OPENMP)
+   MPI_Finalize();
+#endif
 }
 
-// The rhs function in du/dt = R(t,u)
-PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
+// Add flux differences to res for the cells [ib,ie) x [jb,je). Each cell is
+// updated by its own faces in a fixed order, so the result does not depend on
+// how the owned cells are split into blocks. q is the state with ghost values.
+// uL, uR are buffers for nvar*(ie-ib+1) reconstructed values; they do not
+// overlap q, so that the reconstruction loops vectorize without alias checks.
+void fluxes(double *restrict uL, double *restrict uR, PetscScalar ***q, PetscScalar ***res,
+            PetscInt ib, PetscInt ie, PetscInt jb, PetscInt je)
 {
-   AppCtx*        ctx = (AppCtx*) ptr;
-   DM             da;
-   Vec            localU;
-   PetscScalar    ***u;
-   PetscScalar    ***res;
-   PetscInt       i, j, ibeg, jbeg, nlocx, nlocy, d;
-   PetscReal      UL[nvar], UR[nvar], flux[nvar], lam;
-   PetscErrorCode ierr;
+   const PetscInt n = ie - ib, nf = n + 1;
+   PetscInt       i, j, d;
+   PetscReal      UL[nvar], UR[nvar], flux[nvar];
 
-   ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
-   ierr = DMGetLocalVector(da,&localU); CHKERRQ(ierr);
-   ierr = DMGlobalToLocalBegin(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
-   ierr = DMGlobalToLocalEnd(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
-   ierr = DMDAVecGetArrayDOFRead(da, localU, &u); CHKERRQ(ierr);
-   ierr = DMDAVecGetArrayDOF(da, R, &res); CHKERRQ(ierr);
-
-   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
-
-   // ---Begin res computation---
-   // Set residual 0
-   for(j=jbeg; j<jbeg+nlocy; ++j)
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-         for(d=0; d<nvar; ++d)
-            res[j][i][d] = 0;
+   if(n <= 0 || je <= jb) return;
 
    // x fluxes
-   for(i=ibeg; i<ibeg+nlocx+1; ++i)
-      for(j=jbeg; j<jbeg+nlocy; ++j)
+   for(j=jb; j<je; ++j)
+   {
+      // Reconstruct at faces between i-1, i for i=ib,...,ie
+      for(d=0; d<nvar; ++d)
+      {
+         const double *v = &q[j][ib][d];
+         for(i=0; i<nf; ++i)
+         {
+            const PetscInt k = nvar*i;
+            uL[d*nf+i] = weno5(v[k-3*nvar],v[k-2*nvar],v[k-nvar],v[k],v[k+nvar]);
+            uR[d*nf+i] = weno5(v[k+2*nvar],v[k+nvar],v[k],v[k-nvar],v[k-2*nvar]);
+         }
+      }
+
+      for(i=ib; i<ie+1; ++i)
       {
          // face between i-1, i
          for(d=0; d<nvar; ++d)
          {
-            UL[d] = weno5(u[j][i-3][d],u[j][i-2][d],u[j][i-1][d],u[j][i][d],u[j][i+1][d]);
-            UR[d] = weno5(u[j][i+2][d],u[j][i+1][d],u[j][i][d],u[j][i-1][d],u[j][i-2][d]);
+            UL[d] = uL[d*nf+i-ib];
+            UR[d] = uR[d*nf+i-ib];
          }
          numflux(UL, UR, 1.0, 0.0, flux);
-         if(i==ibeg)
+         if(i==ib)
          {
             for(d=0; d<nvar; ++d)
                res[j][i][d] -= dy * flux[d];
          }
-         else if(i==ibeg+nlocx)
+         else if(i==ie)
          {
             for(d=0; d<nvar; ++d)
                res[j][i-1][d] += dy * flux[d];
@@ -345,24 +401,40 @@ PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
             }
          }
       }
+   }
 
    // y fluxes
-   for(j=jbeg; j<jbeg+nlocy+1; ++j)
-      for(i=ibeg; i<ibeg+nlocx; ++i)
+   for(j=jb; j<je+1; ++j)
+   {
+      // Reconstruct at faces between j-1, j for i=ib,...,ie-1
+      for(d=0; d<nvar; ++d)
+      {
+         const double *vm3 = &q[j-3][ib][d], *vm2 = &q[j-2][ib][d];
+         const double *vm1 = &q[j-1][ib][d], *v0  = &q[j][ib][d];
+         const double *vp1 = &q[j+1][ib][d], *vp2 = &q[j+2][ib][d];
+         for(i=0; i<n; ++i)
+         {
+            const PetscInt k = nvar*i;
+            uL[d*nf+i] = weno5(vm3[k],vm2[k],vm1[k],v0[k],vp1[k]);
+            uR[d*nf+i] = weno5(vp2[k],vp1[k],v0[k],vm1[k],vm2[k]);
+         }
+      }
+
+      for(i=ib; i<ie; ++i)
       {
          // face between j-1, j
          for(d=0; d<nvar; ++d)
          {
-            UL[d] = weno5(u[j-3][i][d],u[j-2][i][d],u[j-1][i][d],u[j][i][d],u[j+1][i][d]);
-            UR[d] = weno5(u[j+2][i][d],u[j+1][i][d],u[j][i][d],u[j-1][i][d],u[j-2][i][d]);
+            UL[d] = uL[d*nf+i-ib];
+            UR[d] = uR[d*nf+i-ib];
          }
          numflux(UL, UR, 0.0, 1.0, flux);
-         if(j==jbeg)
+         if(j==jb)
          {
             for(d=0; d<nvar; ++d)
                res[j][i][d] -= dx * flux[d];
          }
-         else if(j==jbeg+nlocy)
+         else if(j==je)
          {
             for(d=0; d<nvar; ++d)
                res[j-1][i][d] += dx * flux[d];
@@ -376,8 +448,96 @@ PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
             }
          }
       }
+   }
+}
+
+// Part [*b,*e) of the n items starting at b0, for thread t of nt
+static inline void thread_range(PetscInt b0, PetscInt n, int t, int nt,
+                                PetscInt *b, PetscInt *e)
+{
+   *b = b0 + (n*t)/nt;
+   *e = b0 + (n*(t+1))/nt;
+}
+
+// Split the block [ib,ie) x [jb,je) among the threads along its longer side.
+// Each thread updates only its own cells and has its own buffers.
+void fluxes_threads(AppCtx *ctx, PetscScalar ***q, PetscScalar ***res,
+                    PetscInt ib, PetscInt ie, PetscInt jb, PetscInt je)
+{
+   if(ie <= ib || je <= jb) return;
+#pragma omp parallel
+   {
+      int      t = 0, nt = 1;
+      PetscInt b, e;
+#if defined(_OPENMP)
+      t  = omp_get_thread_num();
+      nt = omp_get_num_threads();
+#endif
+      double *uL = ctx->UL + t*ctx->lu, *uR = ctx->UR + t*ctx->lu;
+      if(ie-ib > je-jb)
+      {
+         thread_range(ib, ie-ib, t, nt, &b, &e);
+         fluxes(uL, uR, q, res, b, e, jb, je);
+      }
+      else
+      {
+         thread_range(jb, je-jb, t, nt, &b, &e);
+         fluxes(uL, uR, q, res, ib, ie, b, e);
+      }
+   }
+}
+
+// The rhs function in du/dt = R(t,u)
+PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
+{
+   AppCtx*        ctx = (AppCtx*) ptr;
+   DM             da;
+   Vec            localU;
+   PetscScalar    ***u, ***ug;
+   PetscScalar    ***res;
+   PetscInt       i, j, ibeg, jbeg, nlocx, nlocy, d;
+   PetscInt       ni0, ni1, nj0, nj1;
+   PetscReal      lam;
+   PetscErrorCode ierr;
+
+   ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
+   ierr = DMGetLocalVector(da,&localU); CHKERRQ(ierr);
+   // Start the ghost exchange, and work on the owned cells while it is going on
+   ierr = DMGlobalToLocalBegin(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
+   ierr = DMDAVecGetArrayDOFRead(da, U, &ug); CHKERRQ(ierr);
+   ierr = DMDAVecGetArrayDOF(da, R, &res); CHKERRQ(ierr);
+
+   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+
+   // Interior cells [ni0,ni1) x [nj0,nj1) whose stencil has only owned cells.
+   // The remaining owned cells form four strips along the sides.
+   ni0 = ibeg + PetscMin(sw, nlocx); ni1 = PetscMax(ni0, ibeg+nlocx-sw);
+   nj0 = jbeg + PetscMin(sw, nlocy); nj1 = PetscMax(nj0, jbeg+nlocy-sw);
+
+   // ---Begin res computation---
+   // Set residual 0
+#pragma omp parallel for private(i,d)
+   for(j=jbeg; j<jbeg+nlocy; ++j)
+      for(i=ibeg; i<ibeg+nlocx; ++i)
+         for(d=0; d<nvar; ++d)
+            res[j][i][d] = 0;
+
+   // Interior cells need no ghost values
+   fluxes_threads(ctx, ug, res, ni0, ni1, nj0, nj1);
+   ierr = DMDAVecRestoreArrayDOFRead(da, U, &ug); CHKERRQ(ierr);
+
+   // Finish the ghost exchange
+   ierr = DMGlobalToLocalEnd(da, U, INSERT_VALUES, localU); CHKERRQ(ierr);
+   ierr = DMDAVecGetArrayDOFRead(da, localU, &u); CHKERRQ(ierr);
+
+   // Boundary strips
+   fluxes_threads(ctx, u, res, ibeg, ibeg+nlocx, jbeg, nj0);
+   fluxes_threads(ctx, u, res, ibeg, ibeg+nlocx, nj1, jbeg+nlocy);
+   fluxes_threads(ctx, u, res, ibeg, ni0, nj0, nj1);
+   fluxes_threads(ctx, u, res, ni1, ibeg+nlocx, nj0, nj1);
 
    lam = 1.0/(dx*dy);
+#pragma omp parallel for private(i,d)
    for(j=jbeg; j<jbeg+nlocy; ++j)
       for(i=ibeg; i<ibeg+nlocx; ++i)
          for(d=0; d<nvar; ++d)
@@ -406,9 +566,20 @@ PetscErrorCode Monitor(TS ts,PetscInt step,PetscReal time,Vec U,void *ptr)
 
    ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
 
-   if(step > 0 && (step%ctx->si == 0 || PetscAbs(time-ctx->Tf) < 1.0e-13))
+   if(step > ctx->step0 && (step%ctx->si == 0 || PetscAbs(time-ctx->Tf) < 1.0e-13))
+   {
+      ierr = savesol(time, da, U, &ctx->out); CHKERRQ(ierr);
+   }
+
+   // Write checkpoints alternately into two files, so that one is complete
+   // even if the job stops while writing the other.
+   if(ctx->ci > 0 && step > ctx->step0 && step%ctx->ci == 0 && !(PetscAbs(time-ctx->Tf) < 1.0e-13))
    {
-      ierr = savesol(time, da, U); CHKERRQ(ierr);
+      char      filename[32];
+      PetscReal dt;
+      sprintf(filename, "checkpoint-%d.dat", (int)((step/ctx->ci)%2));
+      ierr = TSGetTimeStep(ts, &dt); CHKERRQ(ierr);
+      ierr = write_checkpoint(filename, U, time, step, dt, ctx->out.c); CHKERRQ(ierr);
    }
 
    // If final time reached, dont do anything else, return from function.
@@ -422,6 +593,7 @@ PetscErrorCode Monitor(TS ts,PetscInt step,PetscReal time,Vec U,void *ptr)
       ierr = DMDAVecGetArrayDOFRead(da, U, &u); CHKERRQ(ierr);
 
       dtlocal = 1.0e20;
+#pragma omp parallel for private(i) reduction(min:dtlocal)
       for(j=jbeg; j<jbeg+nlocy; ++j)
          for(i=ibeg; i<ibeg+nlocx; ++i)
          {
@@ -0,0 +1,185 @@
+//------------------------------------------------------------------------------
+// Logarithmic mean (b - a)/(log(b) - log(a)) of a, b > 0, as needed by the
+// entropy conserving fluxes. With f = (b-a)/(b+a) and u = f^2
+//    (b - a)/log(b/a) = 0.5*(a+b)/F(u),   F(u) = atanh(f)/f = sum u^k/(2k+1)
+// The same series gives the logarithm: writing b/a = m 2^e with m in
+// [sqrt(1/2), sqrt(2)) and s = (m-1)/(m+1),
+//    log(b/a) = e log(2) + 2 s F(s^2),   s^2 <= (3 - 2 sqrt(2))^2 = 0.0294
+// so eleven terms of F are enough for both to full double precision. The
+// series form is taken for u below this bound, the logarithm form above it.
+// Only +, *, / and integer operations are needed, no calls to pow or log.
+// logavg computes only the form it needs, one face at a time. a and b must
+// be normal numbers.
+// logavg_log takes log(a) and log(b) that have been computed before.
+// 1d/euler_entropy_stable also includes this file.
+//------------------------------------------------------------------------------
+#ifndef LOGAVG_H
+#define LOGAVG_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOGAVG_U 0.0294372515228594     // (3 - 2 sqrt(2))^2
+
+// F(u) up to u^10, the next term is below 1.0e-18 for u < LOGAVG_U
+static inline double logavg_series(const double u)
+{
+   return 1.0 + u*(1.0/3.0 + u*(1.0/5.0 + u*(1.0/7.0 + u*(1.0/9.0
+              + u*(1.0/11.0 + u*(1.0/13.0 + u*(1.0/15.0 + u*(1.0/17.0
+              + u*(1.0/19.0 + u*(1.0/21.0))))))))));
+}
+
+// log(x) for a positive normal x
+static inline double logavg_logx(const double x)
+{
+   const double ln2_hi = 6.93147180369123816490e-01;
+   const double ln2_lo = 1.90821492927058770002e-10;
+   uint64_t ix, im;
+   int64_t  e;
+   double   m, s;
+
+   // x = m 2^e, m in [sqrt(1/2), sqrt(2))
+   memcpy(&ix, &x, sizeof(double));
+   e  = (int64_t)(ix - 0x3fe6a09e667f3bcdULL) >> 52;
+   im = ix - ((uint64_t)e << 52);
+   memcpy(&m, &im, sizeof(double));
+   s  = (m - 1.0)/(m + 1.0);
+   return e*ln2_hi + (2.0*s*logavg_series(s*s) + e*ln2_lo);
+}
+
+// For one pair at a time
+static inline double logavg(const double a, const double b)
+{
+   const double f = (b - a)/(b + a);
+   const double u = f*f;
+   if(u < LOGAVG_U)
+      return 0.5*(a + b)/logavg_series(u);
+   else
+      return (b - a)/logavg_logx(b/a);
+}
+
+// la = log(a), lb = log(b)
+static inline double logavg_log(const double a, const double b,
+                                const double la, const double lb)
+{
+   const double f = (b - a)/(b + a);
+   const double u = f*f;
+   if(u < LOGAVG_U)
+      return 0.5*(a + b)/logavg_series(u);
+   else
+      return (b - a)/(lb - la);
+}
+
+//------------------------------------------------------------------------------
+// Accuracy and speed of the above. The reference is computed in long double
+// with log1p, which is accurate also when b is close to a. Relative errors
+// are given in units of the double precision epsilon.
+//------------------------------------------------------------------------------
+static inline double logavg_random(unsigned long long *s)
+{
+   *s = 6364136223846793005ULL * (*s) + 1442695040888963407ULL;
+   return (double)(*s >> 11) / 9007199254740992.0;
+}
+
+static inline long double logavg_ref(const double a, const double b)
+{
+   if(a == b) return a;
+   return ((long double)b - (long double)a)
+          / log1pl(((long double)b - (long double)a)/(long double)a);
+}
+
+// The previous form, with the libm log and a shorter series
+static inline double logavg_libm(const double a, const double b)
+{
+   const double xi = b/a;
+   const double f = (xi - 1.0)/(xi + 1.0);
+   const double u = f*f;
+   if(u < 1.0e-2)
+      return 0.5*(a + b)/(1.0 + u/3.0 + u*u/5.0 + u*u*u/7.0);
+   else
+      return 0.5*(a + b)*2.0*f/log(xi);
+}
+
+static inline double logavg_elapsed(const clock_t t0)
+{
+   return (double)(clock() - t0)/CLOCKS_PER_SEC;
+}
+
+static inline void logavg_check(const int n)
+{
+   const double eps = 2.220446049250313e-16;
+   double *a = (double*)malloc(n*sizeof(double));
+   double *b = (double*)malloc(n*sizeof(double));
+   double *la = (double*)malloc(n*sizeof(double));
+   double *lb = (double*)malloc(n*sizeof(double));
+   unsigned long long seed = 12345;
+   double err[4], sum;
+   clock_t t0;
+   int k, c, nrep;
+
+   printf("logavg: relative error / eps for b = a*(1+d), a in [1e-6,1e6]\n");
+   printf("   %8s %12s %12s %12s %12s\n", "d", "logavg", "logavg_log",
+          "log(b/a)", "libm log");
+   for(c=-16; c<=3; ++c)
+   {
+      const double d = pow(10.0, c);
+      for(k=0; k<n; ++k)
+      {
+         a[k] = pow(10.0, -6.0 + 12.0*logavg_random(&seed));
+         b[k] = a[k]*(1.0 + d*(2.0*logavg_random(&seed) - 1.0 + 1.0e-3));
+         if(b[k] <= 0.0) b[k] = a[k]*d;
+         la[k] = log(a[k]);
+         lb[k] = log(b[k]);
+      }
+      err[0] = err[1] = err[2] = err[3] = 0.0;
+      for(k=0; k<n; ++k)
+      {
+         const long double ref = logavg_ref(a[k], b[k]);
+         err[0] = fmax(err[0], fabsl((logavg(a[k], b[k]) - ref)/ref));
+         err[1] = fmax(err[1], fabsl((logavg_log(a[k], b[k], la[k], lb[k]) - ref)/ref));
+         err[3] = fmax(err[3], fabsl((logavg_libm(a[k], b[k]) - ref)/ref));
+         // log of the rounded ratio, which is what logavg_logx is given
+         const double xi = b[k]/a[k];
+         if(xi != 1.0)
+            err[2] = fmax(err[2], fabsl((logavg_logx(xi) - logl(xi))/logl(xi)));
+      }
+      printf("   %8.0e %12.2f %12.2f %12.2f %12.4g\n", d, err[0]/eps,
+             err[1]/eps, err[2]/eps, err[3]/eps);
+   }
+
+   // Throughput, half of the pairs close to each other
+   for(k=0; k<n; ++k)
+   {
+      a[k] = 0.5 + logavg_random(&seed);
+      b[k] = (k%2) ? a[k]*(1.0 + 0.01*logavg_random(&seed))
+                   : 0.5 + logavg_random(&seed);
+      la[k] = log(a[k]);
+      lb[k] = log(b[k]);
+   }
+   nrep = 1 + 20000000/n;
+   sum = 0.0;
+   t0 = clock();
+   for(c=0; c<nrep; ++c)
+      for(k=0; k<n; ++k)
+         sum += logavg_libm(a[k], b[k]);
+   printf("libm log    : %e pairs/s\n", (double)n*nrep/logavg_elapsed(t0));
+   t0 = clock();
+   for(c=0; c<nrep; ++c)
+      for(k=0; k<n; ++k)
+         sum += logavg(a[k], b[k]);
+   printf("logavg      : %e pairs/s\n", (double)n*nrep/logavg_elapsed(t0));
+   t0 = clock();
+   for(c=0; c<nrep; ++c)
+      for(k=0; k<n; ++k)
+         sum += logavg_log(a[k], b[k], la[k], lb[k]);
+   printf("logavg_log  : %e pairs/s\n", (double)n*nrep/logavg_elapsed(t0));
+   if(sum == 0.0) printf("%e\n", sum);
+
+   free(a); free(b); free(la); free(lb);
+}
+
+#endif
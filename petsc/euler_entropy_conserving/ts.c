@@ -3,6 +3,9 @@ static char help[] = "Solves 2d Euler equations.\n\n";
 #include <petscdm.h>
 #include <petscdmda.h>
 #include <petscts.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #define min(a,b)  ( (a < b) ? a : b )
 #define nvar  4
@@ -16,6 +19,9 @@ const double gas_gamma = 1.4;
 const double gas_const = 1.0;
 double dx, dy;
 
+#include "savevtk.h"
+#include "logavg.h"
+
 typedef enum { flux_central,flux_kepec2,flux_kepec4,flux_kep2,flux_mkep2,
                flux_mkep4,flux_kg2 } FluxScheme;
 const char *const FluxSchemes[] = {"central","kepec2","kepec4","kep2","mkep2",
@@ -30,10 +36,13 @@ typedef struct
    PetscReal dt, cfl, Tf;
    PetscInt  max_steps, si;
    FluxScheme flux_scheme;
+   double    ***q, **qrows, *qmem; // cached states on the ghosted local grid
+   Output    out;
 } AppCtx;
 
 extern PetscErrorCode RHSFunction(TS,PetscReal,Vec,Vec,void*);
 extern PetscErrorCode Monitor(TS,PetscInt,PetscReal,Vec,void*);
+extern PetscErrorCode check_fluxes(TS,Vec,AppCtx*,PetscInt);
 
 // Isentropic vortex
 void initcond_vortex(const double x, const double y, double *Prim)
@@ -96,72 +105,62 @@ double dt_local(const double *Con)
    return 1.0/(sx/dx + sy/dy);
 }
 
+// State of a cell cached for the flux functions: the conserved variables,
+// then the primitive variables, beta = rho/(2p), u^2+v^2, and the logarithms
+// of rho and beta which are needed only by the KEPEC fluxes.
+enum { q_rho, q_mx, q_my, q_E, q_u, q_v, q_p, q_beta, q_q2, q_logr, q_logb, nq };
+
+// Fill the cache q from the conserved variables U
+void cache_state(const double *U, const PetscBool logs, double *q)
+{
+   double P[nvar];
+   con2prim(U, P);
+   for(int i=0; i<nvar; ++i) q[i] = U[i];
+   q[q_u]    = P[1];
+   q[q_v]    = P[2];
+   q[q_p]    = P[3];
+   q[q_beta] = 0.5 * P[0] / P[3];
+   q[q_q2]   = pow(P[1],2) + pow(P[2],2);
+   if(logs)
+   {
+      q[q_logr] = log(P[0]);
+      q[q_logb] = log(q[q_beta]);
+   }
+}
+
 // Simple average flux
-void avgflux(const double *Ul, const double *Ur, 
+void avgflux(const double *ql, const double *qr,
              const double nx, const double ny, 
              double *flux)
 {
-   double Pl[nvar], Pr[nvar];
-   con2prim(Ul, Pl);
-   con2prim(Ur, Pr);
-
    double fluxl[nvar], fluxr[nvar];
 
-  fluxl[0] = Ul[1]*nx + Ul[2]*ny;
-  fluxl[1] = Pl[3]*nx + Pl[1]*fluxl[0];
-  fluxl[2] = Pl[3]*ny + Pl[2]*fluxl[0];
-  fluxl[3] = (Ul[3]+Pl[3])*(Pl[1]*nx + Pl[2]*ny);
+  fluxl[0] = ql[q_mx]*nx + ql[q_my]*ny;
+  fluxl[1] = ql[q_p]*nx + ql[q_u]*fluxl[0];
+  fluxl[2] = ql[q_p]*ny + ql[q_v]*fluxl[0];
+  fluxl[3] = (ql[q_E]+ql[q_p])*(ql[q_u]*nx + ql[q_v]*ny);
 
-  fluxr[0] = Ur[1]*nx + Ur[2]*ny;
-  fluxr[1] = Pr[3]*nx + Pr[1]*fluxr[0];
-  fluxr[2] = Pr[3]*ny + Pr[2]*fluxr[0];
-  fluxr[3] = (Ur[3]+Pr[3])*(Pr[1]*nx + Pr[2]*ny);
+  fluxr[0] = qr[q_mx]*nx + qr[q_my]*ny;
+  fluxr[1] = qr[q_p]*nx + qr[q_u]*fluxr[0];
+  fluxr[2] = qr[q_p]*ny + qr[q_v]*fluxr[0];
+  fluxr[3] = (qr[q_E]+qr[q_p])*(qr[q_u]*nx + qr[q_v]*ny);
 
   for(int i=0; i<nvar; ++i) flux[i] = 0.5*(fluxl[i] + fluxr[i]);
 }
 
-double logavg(double a, double b)
-{
-   double xi = b/a;
-   double f = (xi - 1.0) / (xi + 1.0);
-   double u = pow(f,2);
-
-   double FF;
-   if (u < 1.0e-2)
-   {
-      double u2 = pow(u,2);
-      double u3 = u2 * u;
-      FF = 1.0 + u/3.0 + u2/5.0 + u3/7.0;
-   }
-   else
-      FF = 0.5 * log(xi) / f;
-
-   return 0.5*(a+b)/FF;
-}
-
 // KEPEC flux
-void numflux2(const double *Ul, const double *Ur,
+void numflux2(const double *ql, const double *qr,
               const double nx, const double ny,
               double *flux)
 {
-   double ql[nvar], qr[nvar];
-   con2prim(Ul, ql);
-   con2prim(Ur, qr);
-
-   double ql2  = pow(ql[1],2) + pow(ql[2],2);
-   double bl   = 0.5 * ql[0] / ql[3];
-
-   double qr2  = pow(qr[1],2) + pow(qr[2],2);
-   double br   = 0.5 * qr[0] / qr[3];
-
-   double logr = logavg(ql[0], qr[0]);
-   double logb = logavg(bl, br);
-   double u    = 0.5*(ql[1] + qr[1]);
-   double v    = 0.5*(ql[2] + qr[2]);
-   double q2   = 0.5*(ql2 + qr2);
-
-   double ra   = 0.5*(ql[0] + qr[0]);
-   double ba   = 0.5*(bl + br);
+   double logr = logavg_log(ql[q_rho], qr[q_rho], ql[q_logr], qr[q_logr]);
+   double logb = logavg_log(ql[q_beta], qr[q_beta], ql[q_logb], qr[q_logb]);
+   double u    = 0.5*(ql[q_u] + qr[q_u]);
+   double v    = 0.5*(ql[q_v] + qr[q_v]);
+   double q2   = 0.5*(ql[q_q2] + qr[q_q2]);
+
+   double ra   = 0.5*(ql[q_rho] + qr[q_rho]);
+   double ba   = 0.5*(ql[q_beta] + qr[q_beta]);
    double p    = 0.5*ra/ba;
 
    // Rotated velocity
@@ -176,41 +175,34 @@ void numflux2(const double *Ul, const double *Ur,
 }
 
 // 4th order KEPEC flux
-void numflux4(const double *Ull, const double *Ul, 
-              const double *Ur, const double *Urr,
+void numflux4(const double *qll, const double *ql,
+              const double *qr, const double *qrr,
               const double nx, const double ny,
               double *flux)
 {
    double flux1[nvar], flux2[nvar], flux3[nvar];
-   numflux2(Ul,Ur,nx,ny,flux1);
-   numflux2(Ull,Ur,nx,ny,flux2);
-   numflux2(Ul,Urr,nx,ny,flux3);
+   numflux2(ql,qr,nx,ny,flux1);
+   numflux2(qll,qr,nx,ny,flux2);
+   numflux2(ql,qrr,nx,ny,flux3);
    for(int i=0; i<nvar; ++i)
       flux[i] = (4.0/3.0)*flux1[i] - (1.0/6.0)*flux2[i] - (1.0/6.0)*flux3[i];
 }
 
 // KEP flux of Jameson
-void kepflux2(const double *Ul, const double *Ur,
+void kepflux2(const double *ql, const double *qr,
                const double nx, const double ny,
                double *flux)
 {
-   double ql[nvar], qr[nvar];
-   con2prim(Ul, ql);
-   con2prim(Ur, qr);
-
-   double ql2 = pow(ql[1], 2) + pow(ql[2], 2);
-   double qr2 = pow(qr[1], 2) + pow(qr[2], 2);
+   double al2 = gas_gamma * ql[q_p] / ql[q_rho];
+   double ar2 = gas_gamma * qr[q_p] / qr[q_rho];
 
-   double al2 = gas_gamma * ql[3] / ql[0];
-   double ar2 = gas_gamma * qr[3] / qr[0];
+   double Hl = al2 / (gas_gamma-1.0) + 0.5 * ql[q_q2];
+   double Hr = ar2 / (gas_gamma-1.0) + 0.5 * qr[q_q2];
 
-   double Hl = al2 / (gas_gamma-1.0) + 0.5 * ql2;
-   double Hr = ar2 / (gas_gamma-1.0) + 0.5 * qr2;
-
-   double r = 0.5 * (ql[0] + qr[0]);
-   double u = 0.5 * (ql[1] + qr[1]);
-   double v = 0.5 * (ql[2] + qr[2]);
-   double p = 0.5 * (ql[3] + qr[3]);
+   double r = 0.5 * (ql[q_rho] + qr[q_rho]);
+   double u = 0.5 * (ql[q_u] + qr[q_u]);
+   double v = 0.5 * (ql[q_v] + qr[q_v]);
+   double p = 0.5 * (ql[q_p] + qr[q_p]);
    double H = 0.5 * (Hl + Hr);
 
    // Rotated velocity
@@ -224,19 +216,15 @@ void kepflux2(const double *Ul, const double *Ur,
 }
 //------------------------------------------------------------------------------
 // New KEP flux
-void mkepflux2(const double *Ul, const double *Ur,
+void mkepflux2(const double *ql, const double *qr,
                const double nx, const double ny,
                double *flux)
 {
-   double ql[nvar], qr[nvar];
-   con2prim(Ul, ql);
-   con2prim(Ur, qr);
-
-   double r = 0.5 * (ql[0] + qr[0]);
-   double u = 0.5 * (ql[1] + qr[1]);
-   double v = 0.5 * (ql[2] + qr[2]);
-   double p = 0.5 * (ql[3] + qr[3]);
-   double E = 0.5 * (Ul[3] + Ur[3]);
+   double r = 0.5 * (ql[q_rho] + qr[q_rho]);
+   double u = 0.5 * (ql[q_u] + qr[q_u]);
+   double v = 0.5 * (ql[q_v] + qr[q_v]);
+   double p = 0.5 * (ql[q_p] + qr[q_p]);
+   double E = 0.5 * (ql[q_E] + qr[q_E]);
 
    // Rotated velocity
    double un = u * nx + v * ny;
@@ -248,34 +236,30 @@ void mkepflux2(const double *Ul, const double *Ur,
    flux[3] = (E + p) * un;
 }
 // 4th order modified KEP flux
-void mkepflux4(const double *Ull, const double *Ul,
-               const double *Ur, const double *Urr,
+void mkepflux4(const double *qll, const double *ql,
+               const double *qr, const double *qrr,
                const double nx, const double ny,
                double *flux)
 {
    double flux1[nvar], flux2[nvar], flux3[nvar];
-   mkepflux2(Ul, Ur, nx, ny, flux1);
-   mkepflux2(Ull, Ur, nx, ny, flux2);
-   mkepflux2(Ul, Urr, nx, ny, flux3);
+   mkepflux2(ql, qr, nx, ny, flux1);
+   mkepflux2(qll, qr, nx, ny, flux2);
+   mkepflux2(ql, qrr, nx, ny, flux3);
    for (int i = 0; i < nvar; ++i)
       flux[i] = (4.0 / 3.0) * flux1[i] - (1.0 / 6.0) * flux2[i] - (1.0 / 6.0) * flux3[i];
 }
 // Kennedy and Gruber flux
-void kgflux2(const double *Ul, const double *Ur,
+void kgflux2(const double *ql, const double *qr,
              const double nx, const double ny,
              double *flux)
 {
-   double ql[nvar], qr[nvar];
-   con2prim(Ul, ql);
-   con2prim(Ur, qr);
+   double el = ql[q_E]/ql[q_rho];
+   double er = qr[q_E]/qr[q_rho];
 
-   double el = Ul[3]/Ul[0];
-   double er = Ur[3]/Ur[0];
-
-   double r = 0.5 * (ql[0] + qr[0]);
-   double u = 0.5 * (ql[1] + qr[1]);
-   double v = 0.5 * (ql[2] + qr[2]);
-   double p = 0.5 * (ql[3] + qr[3]);
+   double r = 0.5 * (ql[q_rho] + qr[q_rho]);
+   double u = 0.5 * (ql[q_u] + qr[q_u]);
+   double v = 0.5 * (ql[q_v] + qr[q_v]);
+   double p = 0.5 * (ql[q_p] + qr[q_p]);
    double e = 0.5 * (el + er);
 
    // Rotated velocity
@@ -288,7 +272,7 @@ void kgflux2(const double *Ul, const double *Ur,
    flux[3] = (r * e + p) * un;
 }
 //------------------------------------------------------------------------------
-PetscErrorCode savesol(double t, DM da, Vec ug)
+PetscErrorCode savesol(double t, DM da, Vec ug, Output *out)
 {
    PetscErrorCode ierr;
    char           filename[32] = "sol";
@@ -297,7 +281,13 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    FILE           *fp;
    Vec            ul;
    PetscScalar    ***u;
-   static int     c = 0;
+
+   if(out->format == output_vtk)
+   {
+      ierr = savevtk(out, out->c, t, da, ug); CHKERRQ(ierr);
+      ++out->c;
+      return(0);
+   }
 
    ierr = DMGetLocalVector(da, &ul); CHKERRQ(ierr);
    ierr = DMGlobalToLocalBegin(da, ug, INSERT_VALUES, ul); CHKERRQ(ierr);
@@ -310,7 +300,7 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    int jend = PetscMin(jbeg+nlocy+1, ny);
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
-   sprintf(filename, "sol-%03d-%03d.plt", c, rank);
+   sprintf(filename, "sol-%03d-%03d.plt", out->c, rank);
    fp = fopen(filename,"w");
    fprintf(fp, "TITLE = \"u_t + u_x + u_y = 0\"\n");
    fprintf(fp, "VARIABLES = x, y, rho, u, v, p\n");
@@ -329,9 +319,45 @@ PetscErrorCode savesol(double t, DM da, Vec ug)
    ierr = DMDAVecRestoreArrayDOFRead(da, ul, &u); CHKERRQ(ierr);
    ierr = DMRestoreLocalVector(da, &ul); CHKERRQ(ierr);
 
-   ++c;
+   ++out->c;
+   return(0);
+}
+//------------------------------------------------------------------------------
+// Allocate the cached states ctx->q[j][i][0..nq-1] on the ghosted local grid,
+// with the same global (i,j) as the DMDA arrays.
+//------------------------------------------------------------------------------
+PetscErrorCode cache_create(DM da, AppCtx *ctx)
+{
+   PetscErrorCode ierr;
+   PetscInt       gxs, gys, gxm, gym, i, j;
+
+   ierr = DMDAGetGhostCorners(da, &gxs, &gys, 0, &gxm, &gym, 0); CHKERRQ(ierr);
+   ierr = PetscMalloc1(gxm*gym*nq, &ctx->qmem); CHKERRQ(ierr);
+   ierr = PetscMalloc1(gxm*gym, &ctx->qrows); CHKERRQ(ierr);
+   ierr = PetscMalloc1(gym, &ctx->q); CHKERRQ(ierr);
+   for(j=0; j<gym; ++j)
+   {
+      for(i=0; i<gxm; ++i)
+         ctx->qrows[j*gxm + i] = ctx->qmem + (j*gxm + i)*nq;
+      ctx->q[j] = ctx->qrows + j*gxm - gxs;
+   }
+   ctx->q -= gys;
    return(0);
 }
+
+PetscErrorCode cache_destroy(DM da, AppCtx *ctx)
+{
+   PetscErrorCode ierr;
+   PetscInt       gys;
+
+   ierr = DMDAGetGhostCorners(da, 0, &gys, 0, 0, 0, 0); CHKERRQ(ierr);
+   ctx->q += gys;
+   ierr = PetscFree(ctx->q); CHKERRQ(ierr);
+   ierr = PetscFree(ctx->qrows); CHKERRQ(ierr);
+   ierr = PetscFree(ctx->qmem); CHKERRQ(ierr);
+   return(0);
+}
+
 //------------------------------------------------------------------------------
 int main(int argc, char *argv[])
 {
@@ -345,17 +371,28 @@ int main(int argc, char *argv[])
    Vec         ug;
    PetscInt    i, j, ibeg, jbeg, nlocx, nlocy;
    PetscMPIInt rank, size;
+   PetscInt    nrep = 0, nlog = 0;
    PetscReal   dtglobal, dtlocal = 1.0e20;
    PetscScalar ***u;
    Problem     problem;
 
+#if defined(_OPENMP)
+   // Only the master thread makes MPI calls
+   int provided;
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#endif
    ierr = PetscInitialize(&argc, &argv, (char*)0, help); CHKERRQ(ierr);
+#if defined(_OPENMP)
+   PetscPrintf(PETSC_COMM_WORLD,"Number of threads per process = %d\n", omp_get_max_threads());
+#endif
 
    ctx.Tf  = 10.0;
    ctx.dt  = -1.0;
    ctx.cfl = -1.0;
    ctx.max_steps = 1000000;
    ctx.si = 100;
+   ctx.flux_scheme = flux_central;
+   OutputCreate(&ctx.out);
 
    MPI_Comm_rank(PETSC_COMM_WORLD, &rank);
    MPI_Comm_size(PETSC_COMM_WORLD, &size);
@@ -365,9 +402,17 @@ int main(int argc, char *argv[])
    ierr = PetscOptionsGetReal(NULL,NULL,"-dt",&ctx.dt,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetReal(NULL,NULL,"-cfl",&ctx.cfl,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetInt(NULL,NULL,"-si",&ctx.si,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetEnum(NULL,NULL,"-sol_format",OutputFormats,(PetscEnum*)&ctx.out.format,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetBool(NULL,NULL,"-sol_single",&ctx.out.single,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetBool(NULL,NULL,"-sol_async",&ctx.out.async,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetEnum(NULL,NULL,"-flux",FluxSchemes,(PetscEnum *)&ctx.flux_scheme, NULL);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-flux_check",&nrep,NULL); CHKERRQ(ierr);
+   ierr = PetscOptionsGetInt(NULL,NULL,"-logavg_check",&nlog,NULL); CHKERRQ(ierr);
    ierr = PetscOptionsGetEnum(NULL,NULL,"-problem",Problems,(PetscEnum *)&problem, NULL);
 
+   // Accuracy and speed of the logarithmic mean on nlog pairs
+   if(nlog > 0 && rank == 0) logavg_check(nlog);
+
    if(problem == prob_vortex)
    {
       xmin = -5.0;
@@ -403,6 +448,8 @@ int main(int argc, char *argv[])
    ierr = PetscObjectSetName((PetscObject) ug, "Solution"); CHKERRQ(ierr);
 
    ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+   ierr = cache_create(da, &ctx); CHKERRQ(ierr);
+
    ierr = DMDAVecGetArrayDOF(da, ug, &u); CHKERRQ(ierr);
    for(j=jbeg; j<jbeg+nlocy; ++j)
       for(i=ibeg; i<ibeg+nlocx; ++i)
@@ -437,7 +484,7 @@ int main(int argc, char *argv[])
    PetscPrintf(PETSC_COMM_WORLD,"Initial time step = %e\n", ctx.dt);
 
    // Save initial condition to file
-   ierr = savesol(0.0, da, ug); CHKERRQ(ierr);
+   ierr = savesol(0.0, da, ug, &ctx.out); CHKERRQ(ierr);
 
    ierr = TSCreate(PETSC_COMM_WORLD,&ts); CHKERRQ(ierr);
    ierr = TSSetDM(ts,da); CHKERRQ(ierr);
@@ -453,16 +500,196 @@ int main(int argc, char *argv[])
    ierr = TSSetFromOptions(ts); CHKERRQ(ierr);
    ierr = TSSetUp(ts); CHKERRQ(ierr);
 
+   if(nrep > 0)
+   {
+      ierr = check_fluxes(ts, ug, &ctx, nrep); CHKERRQ(ierr);
+   }
+
    ierr = TSSolve(ts,ug); CHKERRQ(ierr);
+   ierr = OutputFinish(&ctx.out); CHKERRQ(ierr);
 
    // Destroy everything before finishing
    ierr = VecDestroy(&ug); CHKERRQ(ierr);
+   ierr = cache_destroy(da, &ctx); CHKERRQ(ierr);
    ierr = DMDestroy(&da); CHKERRQ(ierr);
    ierr = TSDestroy(&ts); CHKERRQ(ierr);
 
    ierr = PetscFinalize(); CHKERRQ(ierr);
+#if defined(_OPENMP)
+   MPI_Finalize();
+#endif
 }
 
+// Face fluxes of all schemes with the same arguments: the states of the two
+// cells on either side of the face; the two point fluxes use only ql, qr.
+static inline void face_central(const double *qll, const double *ql,
+                                const double *qr, const double *qrr,
+                                const double nx, const double ny, double *flux)
+{
+   avgflux(ql, qr, nx, ny, flux);
+}
+
+static inline void face_kepec2(const double *qll, const double *ql,
+                               const double *qr, const double *qrr,
+                               const double nx, const double ny, double *flux)
+{
+   numflux2(ql, qr, nx, ny, flux);
+}
+
+static inline void face_kepec4(const double *qll, const double *ql,
+                               const double *qr, const double *qrr,
+                               const double nx, const double ny, double *flux)
+{
+   numflux4(qll, ql, qr, qrr, nx, ny, flux);
+}
+
+static inline void face_kep2(const double *qll, const double *ql,
+                             const double *qr, const double *qrr,
+                             const double nx, const double ny, double *flux)
+{
+   kepflux2(ql, qr, nx, ny, flux);
+}
+
+static inline void face_mkep2(const double *qll, const double *ql,
+                              const double *qr, const double *qrr,
+                              const double nx, const double ny, double *flux)
+{
+   mkepflux2(ql, qr, nx, ny, flux);
+}
+
+static inline void face_mkep4(const double *qll, const double *ql,
+                              const double *qr, const double *qrr,
+                              const double nx, const double ny, double *flux)
+{
+   mkepflux4(qll, ql, qr, qrr, nx, ny, flux);
+}
+
+static inline void face_kg2(const double *qll, const double *ql,
+                            const double *qr, const double *qrr,
+                            const double nx, const double ny, double *flux)
+{
+   kgflux2(ql, qr, nx, ny, flux);
+}
+
+// Set res to the x flux differences of the owned cells in rows [jb,je), using
+// the cached states q. Each row is swept along i, the contiguous direction:
+// the flux at the right face of a cell is kept as the left face flux of the
+// next cell, and each cell of res is written once.
+#define XFLUX_ROWS(scheme)                                                     \
+void xfluxes_##scheme(double ***q, PetscScalar ***res,                         \
+                      PetscInt ibeg, PetscInt nlocx, PetscInt jb, PetscInt je) \
+{                                                                              \
+   PetscInt  i, j, d;                                                          \
+   PetscReal fl[nvar], fr[nvar];                                               \
+                                                                               \
+   for(j=jb; j<je; ++j)                                                        \
+   {                                                                           \
+      double **qj = q[j];                                                      \
+      face_##scheme(qj[ibeg-2], qj[ibeg-1], qj[ibeg], qj[ibeg+1], 1.0, 0.0, fl); \
+      for(i=ibeg; i<ibeg+nlocx; ++i)                                           \
+      {                                                                        \
+         /* face between i, i+1 */                                             \
+         face_##scheme(qj[i-1], qj[i], qj[i+1], qj[i+2], 1.0, 0.0, fr);        \
+         for(d=0; d<nvar; ++d)                                                 \
+         {                                                                     \
+            res[j][i][d] = dy * fr[d] - dy * fl[d];                            \
+            fl[d] = fr[d];                                                     \
+         }                                                                     \
+      }                                                                        \
+   }                                                                           \
+}
+
+// The previous x sweep, which goes down the columns and adds the x flux
+// differences to res; only used to compare with XFLUX_ROWS in check_fluxes.
+#define XFLUX_COLUMNS(scheme)                                                  \
+void xfluxes_columns_##scheme(double ***q, PetscScalar ***res,                 \
+                      PetscInt ibeg, PetscInt nlocx, PetscInt jb, PetscInt je) \
+{                                                                              \
+   PetscInt  i, j, d;                                                          \
+   PetscReal flux[nvar];                                                       \
+                                                                               \
+   for(i=ibeg; i<ibeg+nlocx+1; ++i)                                            \
+      for(j=jb; j<je; ++j)                                                     \
+      {                                                                        \
+         /* face between i-1, i */                                             \
+         face_##scheme(q[j][i-2], q[j][i-1], q[j][i], q[j][i+1], 1.0, 0.0,     \
+                       flux);                                                  \
+         if(i > ibeg)                                                          \
+            for(d=0; d<nvar; ++d)                                              \
+               res[j][i-1][d] += dy * flux[d];                                 \
+         if(i < ibeg+nlocx)                                                    \
+            for(d=0; d<nvar; ++d)                                              \
+               res[j][i][d] -= dy * flux[d];                                   \
+      }                                                                        \
+}
+
+// Set res to the flux differences for the owned cells in rows [jb,je). Each
+// cell is updated by its own faces in a fixed order, so the rows can be split
+// among threads; the y faces between two parts are computed by both.
+// FLUX_SWEEP(scheme) defines fluxes_scheme with face_scheme inlined into the
+// face loops, so the flux scheme is chosen once per residual evaluation.
+#define FLUX_SWEEP(scheme)                                                     \
+XFLUX_ROWS(scheme)                                                             \
+XFLUX_COLUMNS(scheme)                                                          \
+void fluxes_##scheme(double ***q, PetscScalar ***res,                          \
+                     PetscInt ibeg, PetscInt nlocx, PetscInt jb, PetscInt je)  \
+{                                                                              \
+   PetscInt  i, j, d;                                                          \
+   PetscReal flux[nvar];                                                       \
+                                                                               \
+   /* x fluxes */                                                              \
+   xfluxes_##scheme(q, res, ibeg, nlocx, jb, je);                              \
+                                                                               \
+   /* y fluxes */                                                              \
+   for(j=jb; j<je+1; ++j)                                                      \
+      for(i=ibeg; i<ibeg+nlocx; ++i)                                           \
+      {                                                                        \
+         /* face between j-1, j */                                             \
+         face_##scheme(q[j-2][i], q[j-1][i], q[j][i], q[j+1][i], 0.0, 1.0,     \
+                       flux);                                                  \
+         if(j==jb)                                                             \
+         {                                                                     \
+            for(d=0; d<nvar; ++d)                                              \
+               res[j][i][d] -= dx * flux[d];                                   \
+         }                                                                     \
+         else if(j==je)                                                        \
+         {                                                                     \
+            for(d=0; d<nvar; ++d)                                              \
+               res[j-1][i][d] += dx * flux[d];                                 \
+         }                                                                     \
+         else                                                                  \
+         {                                                                     \
+            for(d=0; d<nvar; ++d)                                              \
+            {                                                                  \
+               res[j][i][d]   -= dx * flux[d];                                 \
+               res[j-1][i][d] += dx * flux[d];                                 \
+            }                                                                  \
+         }                                                                     \
+      }                                                                        \
+}
+
+FLUX_SWEEP(central)
+FLUX_SWEEP(kepec2)
+FLUX_SWEEP(kepec4)
+FLUX_SWEEP(kep2)
+FLUX_SWEEP(mkep2)
+FLUX_SWEEP(mkep4)
+FLUX_SWEEP(kg2)
+
+// Sweeps in the order of FluxScheme
+typedef void (*FluxSweep)(double***, PetscScalar***, PetscInt, PetscInt,
+                          PetscInt, PetscInt);
+const FluxSweep flux_sweeps[] = {fluxes_central, fluxes_kepec2, fluxes_kepec4,
+                                 fluxes_kep2, fluxes_mkep2, fluxes_mkep4,
+                                 fluxes_kg2};
+const FluxSweep xflux_rows[] = {xfluxes_central, xfluxes_kepec2, xfluxes_kepec4,
+                                xfluxes_kep2, xfluxes_mkep2, xfluxes_mkep4,
+                                xfluxes_kg2};
+const FluxSweep xflux_columns[] = {xfluxes_columns_central, xfluxes_columns_kepec2,
+                                   xfluxes_columns_kepec4, xfluxes_columns_kep2,
+                                   xfluxes_columns_mkep2, xfluxes_columns_mkep4,
+                                   xfluxes_columns_kg2};
+
 // The rhs function in du/dt = R(t,u)
 PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
 {
@@ -472,7 +699,9 @@ PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
    PetscScalar    ***u;
    PetscScalar    ***res;
    PetscInt       i, j, ibeg, jbeg, nlocx, nlocy, d;
-   PetscReal      flux[nvar], lam;
+   PetscReal      lam;
+   PetscBool      logs;
+   FluxSweep      sweep;
    PetscErrorCode ierr;
 
    ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
@@ -485,101 +714,36 @@ PetscErrorCode RHSFunction(TS ts,PetscReal time,Vec U,Vec R,void* ptr)
    ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
 
    // ---Begin res computation---
-   // Set residual 0
-   for(j=jbeg; j<jbeg+nlocy; ++j)
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-         for(d=0; d<nvar; ++d)
-            res[j][i][d] = 0;
-
-   // x fluxes
-   for(i=ibeg; i<ibeg+nlocx+1; ++i)
-      for(j=jbeg; j<jbeg+nlocy; ++j)
-      {
-         // face between i-1, i
-         if(ctx->flux_scheme == flux_central)
-            avgflux(u[j][i-1], u[j][i], 1.0, 0.0, flux);
-         else if(ctx->flux_scheme == flux_kepec2)
-            numflux2(u[j][i-1], u[j][i], 1.0, 0.0, flux);
-         else if(ctx->flux_scheme == flux_kepec4)
-            numflux4(u[j][i-2], u[j][i-1], u[j][i], u[j][i+1], 1.0, 0.0, flux);
-         else if(ctx->flux_scheme == flux_kep2)
-            kepflux2(u[j][i-1], u[j][i], 1.0, 0.0, flux);
-         else if(ctx->flux_scheme == flux_mkep2)
-            mkepflux2(u[j][i-1], u[j][i], 1.0, 0.0, flux);
-         else if(ctx->flux_scheme == flux_mkep4)
-            mkepflux4(u[j][i-2], u[j][i-1], u[j][i], u[j][i+1], 1.0, 0.0, flux);
-         else if(ctx->flux_scheme == flux_kg2)
-            kgflux2(u[j][i-1], u[j][i], 1.0, 0.0, flux);
-         else
-         {
-            PetscPrintf(PETSC_COMM_WORLD,"Unknown flux !!!\n");
-            exit(0);
-         }
-         if(i==ibeg)
-         {
-            for(d=0; d<nvar; ++d)
-               res[j][i][d] -= dy * flux[d];
-         }
-         else if(i==ibeg+nlocx)
-         {
-            for(d=0; d<nvar; ++d)
-               res[j][i-1][d] += dy * flux[d];
-         }
-         else
-         {
-            for(d=0; d<nvar; ++d)
-            {
-               res[j][i][d]   -= dy * flux[d];
-               res[j][i-1][d] += dy * flux[d];
-            }
-         }
-      }
+   // Cache the states of the owned cells and of the ghost cells along x and
+   // y; the corner ghost cells are not used.
+   logs = (ctx->flux_scheme == flux_kepec2 || ctx->flux_scheme == flux_kepec4)
+          ? PETSC_TRUE : PETSC_FALSE;
+#pragma omp parallel for private(i)
+   for(j=jbeg-sw; j<jbeg+nlocy+sw; ++j)
+   {
+      const PetscBool ghost = (j < jbeg || j >= jbeg+nlocy) ? PETSC_TRUE : PETSC_FALSE;
+      for(i=(ghost ? ibeg : ibeg-sw); i<(ghost ? ibeg+nlocx : ibeg+nlocx+sw); ++i)
+         cache_state(u[j][i], logs, ctx->q[j][i]);
+   }
 
-   // y fluxes
-   for(j=jbeg; j<jbeg+nlocy+1; ++j)
-      for(i=ibeg; i<ibeg+nlocx; ++i)
-      {
-         // face between j-1, j
-         if(ctx->flux_scheme == flux_central)
-            avgflux(u[j-1][i], u[j][i], 0.0, 1.0, flux);
-         else if(ctx->flux_scheme == flux_kepec2)
-            numflux2(u[j-1][i], u[j][i], 0.0, 1.0, flux);
-         else if(ctx->flux_scheme == flux_kepec4)
-            numflux4(u[j-2][i], u[j-1][i], u[j][i], u[j+1][i], 0.0, 1.0, flux);
-         else if(ctx->flux_scheme == flux_kep2)
-            kepflux2(u[j-1][i], u[j][i], 0.0, 1.0, flux);
-         else if(ctx->flux_scheme == flux_mkep2)
-            mkepflux2(u[j-1][i], u[j][i], 0.0, 1.0, flux);
-         else if(ctx->flux_scheme == flux_mkep4)
-            mkepflux4(u[j-2][i], u[j-1][i], u[j][i], u[j+1][i], 0.0, 1.0, flux);
-         else if(ctx->flux_scheme == flux_kg2)
-            kgflux2(u[j-1][i], u[j][i], 0.0, 1.0, flux);
-         else
-         {
-            PetscPrintf(PETSC_COMM_WORLD,"Unknown flux !!!");
-            exit(0);
-         }
-         if(j==jbeg)
-         {
-            for(d=0; d<nvar; ++d)
-               res[j][i][d] -= dx * flux[d];
-         }
-         else if(j==jbeg+nlocy)
-         {
-            for(d=0; d<nvar; ++d)
-               res[j-1][i][d] += dx * flux[d];
-         }
-         else
-         {
-            for(d=0; d<nvar; ++d)
-            {
-               res[j][i][d]   -= dx * flux[d];
-               res[j-1][i][d] += dx * flux[d];
-            }
-         }
-      }
+   // x and y fluxes, rows split among threads
+   sweep = flux_sweeps[ctx->flux_scheme];
+#pragma omp parallel
+   {
+      int      t = 0, nt = 1;
+      PetscInt jb, je;
+#if defined(_OPENMP)
+      t  = omp_get_thread_num();
+      nt = omp_get_num_threads();
+#endif
+      jb = jbeg + (nlocy*t)/nt;
+      je = jbeg + (nlocy*(t+1))/nt;
+      if(je > jb)
+         sweep(ctx->q, res, ibeg, nlocx, jb, je);
+   }
 
    lam = 1.0/(dx*dy);
+#pragma omp parallel for private(i,d)
    for(j=jbeg; j<jbeg+nlocy; ++j)
       for(i=ibeg; i<ibeg+nlocx; ++i)
          for(d=0; d<nvar; ++d)
@@ -610,7 +774,7 @@ PetscErrorCode Monitor(TS ts,PetscInt step,PetscReal time,Vec U,void *ptr)
 
    if(step > 0 && (step%ctx->si == 0 || PetscAbs(time-ctx->Tf) < 1.0e-13))
    {
-      ierr = savesol(time, da, U); CHKERRQ(ierr);
+      ierr = savesol(time, da, U, &ctx->out); CHKERRQ(ierr);
    }
 
    // If final time reached, dont do anything else, return from function.
@@ -624,6 +788,7 @@ PetscErrorCode Monitor(TS ts,PetscInt step,PetscReal time,Vec U,void *ptr)
       ierr = DMDAVecGetArrayDOFRead(da, U, &u); CHKERRQ(ierr);
 
       dtlocal = 1.0e20;
+#pragma omp parallel for private(i) reduction(min:dtlocal)
       for(j=jbeg; j<jbeg+nlocy; ++j)
          for(i=ibeg; i<ibeg+nlocx; ++i)
          {
@@ -639,3 +804,81 @@ PetscErrorCode Monitor(TS ts,PetscInt step,PetscReal time,Vec U,void *ptr)
 
    PetscFunctionReturn(0);
 }
+
+//------------------------------------------------------------------------------
+// Evaluate the residual nrep times with each flux scheme and report the time
+// and the number of faces per second. Then time the x faces alone, swept along
+// the rows as in the residual and down the columns as before, and report the
+// difference between the two.
+//------------------------------------------------------------------------------
+PetscErrorCode check_fluxes(TS ts, Vec ug, AppCtx *ctx, PetscInt nrep)
+{
+   PetscErrorCode ierr;
+   FluxScheme     flux_scheme = ctx->flux_scheme;
+   DM             da;
+   Vec            r[2];
+   PetscInt       nx, ny, ibeg, jbeg, nlocx, nlocy, n, s, c;
+   PetscLogDouble t0, t1;
+   PetscReal      rnorm, dnorm;
+   PetscScalar    ***res;
+   double         time, xtime[2], faces, xfaces;
+
+   ierr = TSGetDM(ts, &da); CHKERRQ(ierr);
+   ierr = DMDAGetInfo(da,0,&nx,&ny,0,0,0,0,0,0,0,0,0,0); CHKERRQ(ierr);
+   ierr = DMDAGetCorners(da, &ibeg, &jbeg, 0, &nlocx, &nlocy, 0); CHKERRQ(ierr);
+   ierr = VecDuplicate(ug, &r[0]); CHKERRQ(ierr);
+   ierr = VecDuplicate(ug, &r[1]); CHKERRQ(ierr);
+   faces = (double)nx*ny*2;
+   xfaces = (double)(nlocx+1)*nlocy;
+   for(s=flux_central; s<=flux_kg2; ++s)
+   {
+      ctx->flux_scheme = (FluxScheme)s;
+      ierr = PetscTime(&t0); CHKERRQ(ierr);
+      for(n=0; n<nrep; ++n)
+      {
+         ierr = RHSFunction(ts, 0.0, ug, r[0], ctx); CHKERRQ(ierr);
+      }
+      ierr = PetscTime(&t1); CHKERRQ(ierr);
+      time = (t1 - t0)/nrep;
+
+      // The states cached by the last residual evaluation are used
+      for(c=0; c<2; ++c)
+      {
+         ierr = VecSet(r[c], 0.0); CHKERRQ(ierr);
+         ierr = DMDAVecGetArrayDOF(da, r[c], &res); CHKERRQ(ierr);
+         ierr = PetscTime(&t0); CHKERRQ(ierr);
+         for(n=0; n<nrep; ++n)
+         {
+            if(c == 0)
+               xflux_rows[s](ctx->q, res, ibeg, nlocx, jbeg, jbeg+nlocy);
+            else
+               xflux_columns[s](ctx->q, res, ibeg, nlocx, jbeg, jbeg+nlocy);
+         }
+         ierr = PetscTime(&t1); CHKERRQ(ierr);
+         xtime[c] = (t1 - t0)/nrep;
+         // Columns accumulate, so sweep once more from zero
+         if(c == 1)
+         {
+            ierr = DMDAVecRestoreArrayDOF(da, r[c], &res); CHKERRQ(ierr);
+            ierr = VecSet(r[c], 0.0); CHKERRQ(ierr);
+            ierr = DMDAVecGetArrayDOF(da, r[c], &res); CHKERRQ(ierr);
+            xflux_columns[s](ctx->q, res, ibeg, nlocx, jbeg, jbeg+nlocy);
+         }
+         ierr = DMDAVecRestoreArrayDOF(da, r[c], &res); CHKERRQ(ierr);
+      }
+      ierr = VecNorm(r[0], NORM_INFINITY, &rnorm); CHKERRQ(ierr);
+      ierr = VecAXPY(r[1], -1.0, r[0]); CHKERRQ(ierr);
+      ierr = VecNorm(r[1], NORM_INFINITY, &dnorm); CHKERRQ(ierr);
+
+      ierr = MPI_Allreduce(MPI_IN_PLACE, &time, 1, MPI_DOUBLE, MPI_MAX, PETSC_COMM_WORLD); CHKERRQ(ierr);
+      ierr = MPI_Allreduce(MPI_IN_PLACE, xtime, 2, MPI_DOUBLE, MPI_MAX, PETSC_COMM_WORLD); CHKERRQ(ierr);
+      PetscPrintf(PETSC_COMM_WORLD,"Flux %-8s: time = %e s, faces/s = %e\n",
+                  FluxSchemes[s], time, faces/time);
+      PetscPrintf(PETSC_COMM_WORLD,"   x faces/s per process: rows = %e, columns = %e, speedup = %f, difference = %e\n",
+                  xfaces/xtime[0], xfaces/xtime[1], xtime[1]/xtime[0], dnorm);
+   }
+   ierr = VecDestroy(&r[0]); CHKERRQ(ierr);
+   ierr = VecDestroy(&r[1]); CHKERRQ(ierr);
+   ctx->flux_scheme = flux_scheme;
+   return(0);
+}
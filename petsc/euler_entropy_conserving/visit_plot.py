@@ -12,7 +12,7 @@ if len(sys.argv) == 1:
 
 variable = sys.argv[1]
 
-OpenDatabase("sol-*.plt database")
+OpenDatabase("sol-*.vtk database")
 
 v = GetView2D()
 v.windowCoords = (0.0, 1.0, 0.0, 1.0)